@@ -0,0 +1,960 @@
+/*
+* libpronoun.c
+* client library for pronound
+* sends requests to pronound daemons and receives the pronouns for users, many at once, over an epoll set that the
+* caller can wait on from its own event loop, or block on through pronoun_wait and pronoun_lookup
+*
+* pronound is free software distributed under GPLv3
+*/
+
+#include "libpronoun.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#define MAX_REPLY 4096 // longer replies are cut short, pronouns files are one line
+#define BATCH_MAX 64   // most users asked for over one connection
+#define ATTEMPT_DELAY_MS 250 // before racing the next address against those already connecting, as in RFC 8305
+
+struct Target {
+    char *spec;      // as given, user@host[:port]
+    char *user;
+    char *host;
+    char *port;
+    void *data;
+    char *reply;       // once answered
+    const char *error; // why it failed, NULL if it hasn't
+    bool queued;       // given to a connection, or done
+    bool single;       // its host doesn't take several queries on a connection
+    bool done;
+    bool cached;       // answered from the cache
+    bool returned;     // by pronoun_next
+};
+
+struct Conn;
+struct Resolve;
+
+// a connect in progress to one of a host's addresses, or the one that won
+struct Attempt {
+    struct Conn *conn;
+    int fd;
+};
+
+/*
+ * a connection to one host, asking for one or more of its users
+ * several users are sent a line each, after which the connection is shut down for writing, and the daemon answers
+ * them in order; a daemon too old for that answers them all with a single reply, so if fewer replies come back than
+ * users were asked for, they are asked for again with a connection each, as is every user of that host after
+ */
+struct Conn {
+    struct pronoun_client *client;
+    int targets[BATCH_MAX]; // indices, as the targets move when more are added
+    int count;
+    int fd; // once connected
+    struct Resolve *resolve;   // while the host is being looked up
+    uint64_t deadline;         // for the whole connection
+    uint64_t connect_deadline; // for connecting, 0 if there is none
+    uint64_t read_deadline;    // for the next data once connected, 0 if there is none
+    int lines;                 // in the reply so far
+    // while connecting: the host's addresses in the order they are tried, a connect started on the next every
+    // ATTEMPT_DELAY_MS, or as soon as one fails, and the first to succeed kept
+    struct addrinfo *addresses;
+    struct addrinfo **order;
+    struct Attempt *attempts;
+    int attempts_size, address_count, next_address, attempting;
+    uint64_t next_attempt;
+    const char *connect_error;
+    char *request;
+    size_t request_len, sent;
+    char *reply;
+    size_t reply_len, reply_size;
+};
+
+/*
+ * reply cache
+ * kept in $XDG_CACHE_HOME/pronoun/cache, so calling pronoun again and again, from a shell prompt say, doesn't go to the
+ * network every time; the file is a fixed size table of fixed size entries, mapped in and locked with flock, found by
+ * the hash of user@host:port and probed linearly for a few slots, where an expired entry or failing that the one
+ * closest to expiry is replaced; replies too long for an entry aren't cached
+ */
+#define CACHE_MAGIC "pronoun1"
+#define CACHE_SLOTS 1024
+#define CACHE_PROBES 8
+#define CACHE_ENTRY 256
+
+struct CacheEntry {
+    uint64_t hash;    // 0 for an empty slot
+    int64_t expires;  // wall clock seconds, as it has to mean the same to the next process
+    uint16_t key_len;
+    uint16_t reply_len;
+    char data[CACHE_ENTRY - 20]; // key then reply
+};
+
+struct CacheFile {
+    char magic[8];
+    uint32_t slots;
+    uint32_t entry_size;
+    struct CacheEntry entries[];
+};
+
+struct pronoun_client {
+    struct pronoun_options options;
+    int epfd;
+    int resolved_fd; // an eventfd in epfd, written to as each host lookup finishes
+    struct Conn *conns; // options.concurrency of them, idle while count is 0
+    struct Target *targets;
+    int target_count, target_size;
+    int first_pending; // targets before it have all been returned
+    struct CacheFile *cache;
+    int cache_fd;
+};
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// split user@host[:port] into the target, false if it isn't one
+static bool parse_target(struct Target *target, const char *spec, const char *default_port) {
+    memset(target, 0, sizeof(*target));
+    target->spec = strdup(spec);
+    target->user = strdup(spec);
+    if (!target->spec || !target->user)
+        return false;
+
+    char *at = strrchr(target->user, '@');
+    if (!at || at == target->user || !at[1])
+        return false;
+    *at = '\0';
+    target->host = at + 1;
+    target->port = (char *)default_port;
+
+    // host:port, or [v6 address]:port
+    char *colon = strrchr(target->host, ':');
+    if (target->host[0] == '[') {
+        char *close = strchr(target->host, ']');
+        if (!close)
+            return false;
+        *close = '\0';
+        target->host++;
+        if (close[1] == ':')
+            target->port = close + 2;
+    } else if (colon && strchr(target->host, ':') == colon) {
+        *colon = '\0';
+        target->port = colon + 1;
+    }
+    return target->host[0] && target->port[0] && !strchr(target->user, '\n');
+}
+
+static void target_free(struct Target *target) {
+    free(target->spec);
+    free(target->user);
+    free(target->reply);
+}
+
+static bool same_host(const struct Target *a, const struct Target *b) {
+    return strcmp(a->host, b->host) == 0 && strcmp(a->port, b->port) == 0;
+}
+
+static void target_finish(struct Target *target, char *reply, const char *error) {
+    target->reply = reply;
+    target->error = error;
+    target->done = true;
+}
+
+static struct Target *conn_target(struct Conn *conn, int i) {
+    return &conn->client->targets[conn->targets[i]];
+}
+
+/*
+ * cache
+ */
+
+// FNV-1a
+static uint64_t cache_hash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+static size_t cache_key(const struct Target *target, char *key, size_t size) {
+    int len = snprintf(key, size, "%s@%s:%s", target->user, target->host, target->port);
+    return len < 0 || (size_t)len >= size ? 0 : (size_t)len;
+}
+
+// map the cache file in, making it if need be; false, and no cache, if it can't be
+static bool cache_open(struct pronoun_client *client) {
+    char path[4096];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg)
+        snprintf(path, sizeof(path), "%s", xdg);
+    else if (home && *home)
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    else
+        return false;
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return false;
+    strncat(path, "/pronoun", sizeof(path) - strlen(path) - 1);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return false;
+    strncat(path, "/cache", sizeof(path) - strlen(path) - 1);
+
+    client->cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (client->cache_fd < 0)
+        return false;
+    size_t size = sizeof(struct CacheFile) + CACHE_SLOTS * sizeof(struct CacheEntry);
+    flock(client->cache_fd, LOCK_EX);
+    struct stat st;
+    bool fresh = fstat(client->cache_fd, &st) < 0 || (size_t)st.st_size != size;
+    // truncating first zeroes the whole table
+    if (fresh && (ftruncate(client->cache_fd, 0) < 0 || ftruncate(client->cache_fd, size) < 0)) {
+        flock(client->cache_fd, LOCK_UN);
+        return false;
+    }
+    struct CacheFile *cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, client->cache_fd, 0);
+    if (cache == MAP_FAILED) {
+        flock(client->cache_fd, LOCK_UN);
+        return false;
+    }
+    // a new file, or one from another version, starts over empty
+    if (memcmp(cache->magic, CACHE_MAGIC, 8) != 0 || cache->slots != CACHE_SLOTS ||
+        cache->entry_size != sizeof(struct CacheEntry)) {
+        memset(cache, 0, size);
+        memcpy(cache->magic, CACHE_MAGIC, 8);
+        cache->slots = CACHE_SLOTS;
+        cache->entry_size = sizeof(struct CacheEntry);
+    }
+    flock(client->cache_fd, LOCK_UN);
+    client->cache = cache;
+    return true;
+}
+
+static void cache_close(struct pronoun_client *client) {
+    if (client->cache)
+        munmap(client->cache, sizeof(struct CacheFile) + CACHE_SLOTS * sizeof(struct CacheEntry));
+    if (client->cache_fd >= 0)
+        close(client->cache_fd);
+    client->cache = NULL;
+    client->cache_fd = -1;
+}
+
+// answer the target from the cache, if it has an unexpired reply
+static bool cache_lookup(struct pronoun_client *client, struct Target *target) {
+    char key[sizeof(((struct CacheEntry *)0)->data)];
+    size_t key_len = cache_key(target, key, sizeof(key));
+    if (!key_len)
+        return false;
+    uint64_t hash = cache_hash(key, key_len);
+    time_t now = time(NULL);
+
+    flock(client->cache_fd, LOCK_SH);
+    char *reply = NULL;
+    for (int i = 0; i < CACHE_PROBES && !reply; i++) {
+        struct CacheEntry *entry = &client->cache->entries[(hash + i) % CACHE_SLOTS];
+        if (entry->hash == hash && entry->key_len == key_len && entry->expires > now &&
+            memcmp(entry->data, key, key_len) == 0 && key_len + entry->reply_len <= sizeof(entry->data))
+            reply = strndup(entry->data + key_len, entry->reply_len);
+    }
+    flock(client->cache_fd, LOCK_UN);
+    if (!reply)
+        return false;
+    target_finish(target, reply, NULL);
+    target->queued = target->cached = true;
+    return true;
+}
+
+static void cache_store(struct pronoun_client *client, const struct Target *target) {
+    char key[sizeof(((struct CacheEntry *)0)->data)];
+    size_t key_len = cache_key(target, key, sizeof(key));
+    size_t reply_len = strlen(target->reply);
+    if (!key_len || key_len + reply_len > sizeof(key))
+        return;
+    uint64_t hash = cache_hash(key, key_len);
+    time_t now = time(NULL);
+
+    flock(client->cache_fd, LOCK_EX);
+    struct CacheEntry *victim = NULL;
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        struct CacheEntry *entry = &client->cache->entries[(hash + i) % CACHE_SLOTS];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0) {
+            victim = entry;
+            break;
+        }
+        if (!victim || (victim->expires > now && entry->expires < victim->expires))
+            victim = entry;
+    }
+    victim->hash = hash;
+    victim->expires = now + client->options.cache_ttl;
+    victim->key_len = key_len;
+    victim->reply_len = reply_len;
+    memcpy(victim->data, key, key_len);
+    memcpy(victim->data + key_len, target->reply, reply_len);
+    flock(client->cache_fd, LOCK_UN);
+}
+
+/*
+ * host lookups
+ * getaddrinfo blocks, so a host name is looked up on a thread of its own, which wakes the client through resolved_fd
+ * when it's done; the connection can give up on it before then, so whichever of the two lets go of it last frees it,
+ * and the thread has its own copy of the eventfd in case the client is gone by then
+ */
+
+struct Resolve {
+    int refs;
+    int fd;
+    char *host, *port;
+    struct addrinfo *result;
+    int error;
+    bool done;
+};
+
+static void resolve_put(struct Resolve *resolve) {
+    if (__atomic_sub_fetch(&resolve->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (resolve->result)
+        freeaddrinfo(resolve->result);
+    close(resolve->fd);
+    free(resolve->host);
+    free(resolve->port);
+    free(resolve);
+}
+
+static void *resolver(void *arg) {
+    struct Resolve *resolve = arg;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // TCP socket
+    resolve->error = getaddrinfo(resolve->host, resolve->port, &hints, &resolve->result);
+    __atomic_store_n(&resolve->done, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(resolve->fd, &one, sizeof(one)) < 0) {
+        // the counter can't overflow from this, and the client reads it whatever it says
+    }
+    resolve_put(resolve);
+    return NULL;
+}
+
+// start looking up host on a thread, NULL if one couldn't be started
+static struct Resolve *resolve_start(struct pronoun_client *client, const char *host, const char *port) {
+    struct Resolve *resolve = calloc(1, sizeof(struct Resolve));
+    if (!resolve)
+        return NULL;
+    resolve->refs = 2;
+    resolve->fd = fcntl(client->resolved_fd, F_DUPFD_CLOEXEC, 0);
+    resolve->host = strdup(host);
+    resolve->port = strdup(port);
+    pthread_attr_t attr;
+    pthread_t thread;
+    bool started = false;
+    if (resolve->fd >= 0 && resolve->host && resolve->port && pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = pthread_create(&thread, &attr, resolver, resolve) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    if (!started) {
+        if (resolve->fd >= 0)
+            close(resolve->fd);
+        free(resolve->host);
+        free(resolve->port);
+        free(resolve);
+        return NULL;
+    }
+    return resolve;
+}
+
+/*
+ * connections
+ */
+
+static void attempt_close(struct Attempt *attempt, int epfd) {
+    if (attempt->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, attempt->fd, NULL);
+        close(attempt->fd);
+    }
+    attempt->fd = -1;
+}
+
+// done connecting, one way or another: close the attempts that lost, keeping the one in fd
+static void conn_end_attempts(struct Conn *conn) {
+    for (int i = 0; i < conn->attempts_size; i++) {
+        if (conn->attempts[i].fd != conn->fd)
+            attempt_close(&conn->attempts[i], conn->client->epfd);
+    }
+    if (conn->addresses)
+        freeaddrinfo(conn->addresses);
+    free(conn->order);
+    conn->addresses = NULL;
+    conn->order = NULL;
+    conn->address_count = conn->next_address = conn->attempting = 0;
+}
+
+/*
+ * the attempts are kept for the next connection rather than freed: events for several of them can come back from one
+ * epoll_wait, and those for attempts closed meanwhile are told apart by their fd being -1
+ */
+static void conn_close(struct Conn *conn) {
+    if (conn->resolve) {
+        resolve_put(conn->resolve);
+        conn->resolve = NULL;
+    }
+    conn_end_attempts(conn);
+    for (int i = 0; i < conn->attempts_size; i++)
+        attempt_close(&conn->attempts[i], conn->client->epfd);
+    conn->fd = -1;
+    conn->connect_error = NULL;
+    conn->count = conn->lines = 0;
+    conn->connect_deadline = conn->read_deadline = 0;
+    free(conn->request);
+    free(conn->reply);
+    conn->request = conn->reply = NULL;
+    conn->request_len = conn->sent = conn->reply_len = conn->reply_size = 0;
+}
+
+// fail every user on the connection, and close it
+static void conn_fail(struct Conn *conn, const char *error) {
+    for (int i = 0; i < conn->count; i++)
+        target_finish(conn_target(conn, i), NULL, error);
+    conn_close(conn);
+}
+
+// ask for the users again a connection each, along with everyone else on their host
+static void conn_fall_back(struct Conn *conn) {
+    struct pronoun_client *client = conn->client;
+    for (int i = 0; i < client->target_count; i++) {
+        if (same_host(&client->targets[i], conn_target(conn, 0)))
+            client->targets[i].single = true;
+    }
+    for (int i = 0; i < conn->count; i++)
+        conn_target(conn, i)->queued = false;
+    conn_close(conn);
+}
+
+/*
+ * hand out the replies, one line each, or the whole reply to a lone user; called once there is a line for every user,
+ * or the daemon closed the connection before that
+ */
+static void conn_finish(struct Conn *conn) {
+    if (conn->reply_len == 0)
+        return conn_fail(conn, "connection closed without a reply");
+    conn->reply[conn->reply_len] = '\0';
+
+    if (conn->count == 1) {
+        target_finish(conn_target(conn, 0), conn->reply, NULL);
+        conn->reply = NULL;
+        return conn_close(conn);
+    }
+
+    if (conn->lines < conn->count)
+        return conn_fall_back(conn);
+
+    // a line cut short loses the newline, and the users after it their replies
+    char *line = conn->reply;
+    for (int i = 0; i < conn->count; i++) {
+        char *newline = line ? strchr(line, '\n') : NULL;
+        if (newline)
+            target_finish(conn_target(conn, i), strndup(line, newline - line + 1), NULL);
+        else
+            target_finish(conn_target(conn, i), NULL, "reply too long");
+        line = newline ? newline + 1 : NULL;
+    }
+    conn_close(conn);
+}
+
+// start connecting to the next address, or the one after if that fails straight away; fails the connection once every
+// address has
+static void conn_attempt(struct Conn *conn) {
+    int epfd = conn->client->epfd;
+    while (conn->next_address < conn->address_count) {
+        struct addrinfo *ai = conn->order[conn->next_address];
+        struct Attempt *attempt = &conn->attempts[conn->next_address++];
+        attempt->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (attempt->fd < 0) {
+            conn->connect_error = strerror(errno);
+            continue;
+        }
+        if (connect(attempt->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            conn->connect_error = strerror(errno);
+            attempt_close(attempt, epfd);
+            continue;
+        }
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = attempt};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, attempt->fd, &ev) < 0) {
+            conn->connect_error = strerror(errno);
+            attempt_close(attempt, epfd);
+            continue;
+        }
+        conn->attempting++;
+        conn->next_attempt = now_ms() + ATTEMPT_DELAY_MS;
+        return;
+    }
+    if (conn->attempting == 0)
+        conn_fail(conn, conn->connect_error ? conn->connect_error : "no addresses");
+}
+
+// an attempt finished connecting: keep it if it succeeded, or move on to the next address if not
+static void attempt_event(struct Attempt *attempt) {
+    struct Conn *conn = attempt->conn;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err) {
+        conn->connect_error = strerror(err);
+        attempt_close(attempt, conn->client->epfd);
+        conn->attempting--;
+        return conn_attempt(conn);
+    }
+    conn->fd = attempt->fd;
+    conn_end_attempts(conn);
+    if (conn->client->options.read_timeout > 0)
+        conn->read_deadline = now_ms() + (uint64_t)(conn->client->options.read_timeout * 1000);
+}
+
+static void conn_connect(struct Conn *conn);
+
+// take the next user waiting, and others of the same host if it takes several, and start looking its host up
+static void conn_start(struct Conn *conn, int first) {
+    struct pronoun_client *client = conn->client;
+    struct Target *target = &client->targets[first];
+    conn->targets[0] = first;
+    conn->count = 1;
+    target->queued = true;
+    for (int i = first + 1; i < client->target_count && conn->count < BATCH_MAX && !target->single; i++) {
+        struct Target *other = &client->targets[i];
+        if (!other->queued && !other->single && same_host(other, target)) {
+            conn->targets[conn->count++] = i;
+            other->queued = true;
+        }
+    }
+
+    uint64_t now = now_ms();
+    conn->deadline = now + (uint64_t)(client->options.timeout * 1000);
+    if (client->options.connect_timeout > 0)
+        conn->connect_deadline = now + (uint64_t)(client->options.connect_timeout * 1000);
+    size_t size = 0;
+    for (int i = 0; i < conn->count; i++)
+        size += strlen(conn_target(conn, i)->user) + 1;
+    conn->request = malloc(size + 1);
+    conn->reply_size = (size_t)conn->count * MAX_REPLY;
+    conn->reply = malloc(conn->reply_size + 1);
+    if (!conn->request || !conn->reply)
+        return conn_fail(conn, "out of memory");
+    for (int i = 0; i < conn->count; i++)
+        conn->request_len += sprintf(conn->request + conn->request_len, "%s\n", conn_target(conn, i)->user);
+
+    // an address needs no lookup, so only a name is handed to a thread
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // TCP socket
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(target->host, target->port, &hints, &conn->addresses) == 0)
+        return conn_connect(conn);
+    conn->addresses = NULL;
+    if ((conn->resolve = resolve_start(client, target->host, target->port)))
+        return;
+    // without a thread, there's nothing for it but to block
+    hints.ai_flags = 0;
+    int err = getaddrinfo(target->host, target->port, &hints, &conn->addresses);
+    if (err != 0)
+        return conn_fail(conn, gai_strerror(err));
+    conn_connect(conn);
+}
+
+// a host lookup finished: connect to what it found
+static void conn_resolved(struct Conn *conn) {
+    struct Resolve *resolve = conn->resolve;
+    conn->resolve = NULL;
+    conn->addresses = resolve->result;
+    resolve->result = NULL;
+    int err = resolve->error;
+    resolve_put(resolve);
+    if (err != 0)
+        return conn_fail(conn, gai_strerror(err));
+    conn_connect(conn);
+}
+
+// race connects to the addresses found for the host
+static void conn_connect(struct Conn *conn) {
+    /*
+     * getaddrinfo sorts the addresses most preferred first, usually IPv6; take turns between that family and the
+     * others from there, so a family that is broken costs at most ATTEMPT_DELAY_MS
+     */
+    for (struct addrinfo *ai = conn->addresses; ai; ai = ai->ai_next)
+        conn->address_count++;
+    conn->order = malloc(conn->address_count * sizeof(struct addrinfo *));
+    if (!conn->order)
+        return conn_fail(conn, "out of memory");
+    if (conn->address_count > conn->attempts_size) {
+        struct Attempt *grown = realloc(conn->attempts, conn->address_count * sizeof(struct Attempt));
+        if (!grown)
+            return conn_fail(conn, "out of memory");
+        conn->attempts = grown;
+        for (int i = conn->attempts_size; i < conn->address_count; i++)
+            conn->attempts[i] = (struct Attempt){.conn = conn, .fd = -1};
+        conn->attempts_size = conn->address_count;
+    }
+    int preferred = conn->addresses->ai_family;
+    struct addrinfo *preferred_next = conn->addresses, *rest = conn->addresses;
+    for (int i = 0; i < conn->address_count; i++) {
+        bool take_preferred = i % 2 == 0;
+        while (preferred_next && preferred_next->ai_family != preferred)
+            preferred_next = preferred_next->ai_next;
+        while (rest && rest->ai_family == preferred)
+            rest = rest->ai_next;
+        if (!preferred_next || (!take_preferred && rest)) {
+            conn->order[i] = rest;
+            rest = rest->ai_next;
+        } else {
+            conn->order[i] = preferred_next;
+            preferred_next = preferred_next->ai_next;
+        }
+    }
+    conn_attempt(conn);
+}
+
+static void conn_event(struct Attempt *attempt, uint32_t events) {
+    struct Conn *conn = attempt->conn;
+    if (attempt->fd < 0)
+        return; // closed since epoll_wait returned
+    if (conn->fd < 0) {
+        attempt_event(attempt);
+        if (conn->fd < 0)
+            return;
+    }
+    if (conn->sent < conn->request_len) {
+        ssize_t n = send(conn->fd, conn->request + conn->sent, conn->request_len - conn->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return;
+            return conn_fail(conn, strerror(errno));
+        }
+        conn->sent += n;
+        if (conn->sent == conn->request_len) {
+            // the daemon answers a lone query and closes, but needs telling when several are done
+            if (conn->count > 1)
+                shutdown(conn->fd, SHUT_WR);
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = attempt};
+            epoll_ctl(conn->client->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+    /*
+     * replies are a line each, so the reply is complete with a line for every user; the daemon closes the connection
+     * after that, unless it keeps connections alive, in which case waiting for it to would hold the lookup up for
+     * nothing; a reply longer than MAX_REPLY per user is cut short, and the rest of it read and dropped up to its
+     * newline
+     */
+    while (true) {
+        size_t room = conn->reply_size - conn->reply_len;
+        char scratch[256];
+        char *buffer = room ? conn->reply + conn->reply_len : scratch;
+        ssize_t n = recv(conn->fd, buffer, room ? room : sizeof(scratch), 0);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return;
+            // a daemon too old for batches closes with the rest of them unread, which resets the connection
+            if (errno == ECONNRESET && conn->reply_len)
+                return conn_finish(conn);
+            return conn_fail(conn, strerror(errno));
+        }
+        if (n == 0)
+            return conn_finish(conn);
+        if (conn->client->options.read_timeout > 0)
+            conn->read_deadline = now_ms() + (uint64_t)(conn->client->options.read_timeout * 1000);
+        for (ssize_t i = 0; i < n; i++)
+            conn->lines += buffer[i] == '\n';
+        if (room)
+            conn->reply_len += n;
+        if (conn->lines >= conn->count) {
+            // anything after the last line a user needs isn't a reply to anything asked
+            char *end = conn->reply;
+            for (int i = 0; i < conn->count && end; i++) {
+                char *newline = memchr(end, '\n', conn->reply_len - (end - conn->reply));
+                end = newline ? newline + 1 : NULL;
+            }
+            if (end)
+                conn->reply_len = end - conn->reply;
+            return conn_finish(conn);
+        }
+    }
+}
+
+// when the connection next needs attention without any event: a timeout, or the next address to race
+static uint64_t conn_due(const struct Conn *conn) {
+    uint64_t due = conn->deadline;
+    if (conn->fd < 0 && conn->connect_deadline && conn->connect_deadline < due)
+        due = conn->connect_deadline;
+    if (conn->fd < 0 && conn->next_address < conn->address_count && conn->next_attempt < due)
+        due = conn->next_attempt;
+    if (conn->fd >= 0 && conn->read_deadline && conn->read_deadline < due)
+        due = conn->read_deadline;
+    return due;
+}
+
+static void conn_timers(struct Conn *conn, uint64_t now) {
+    if (now >= conn->deadline)
+        conn_fail(conn, "timed out");
+    else if (conn->fd < 0 && conn->connect_deadline && now >= conn->connect_deadline)
+        conn_fail(conn, "timed out connecting");
+    else if (conn->fd >= 0 && conn->read_deadline && now >= conn->read_deadline)
+        conn_fail(conn, "timed out waiting for a reply");
+    else if (conn->fd < 0 && conn->next_address < conn->address_count && now >= conn->next_attempt)
+        conn_attempt(conn);
+}
+
+// the next target waiting for a connection, from start on, or -1
+static int next_waiting(const struct pronoun_client *client, int start) {
+    for (int i = start; i < client->target_count; i++) {
+        if (!client->targets[i].queued)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * client
+ */
+
+struct pronoun_client *pronoun_new(const struct pronoun_options *options) {
+    struct pronoun_client *client = calloc(1, sizeof(struct pronoun_client));
+    if (!client)
+        return NULL;
+    if (options)
+        client->options = *options;
+    if (client->options.concurrency <= 0)
+        client->options.concurrency = 16;
+    if (client->options.timeout <= 0)
+        client->options.timeout = 10;
+    if (!client->options.default_port)
+        client->options.default_port = "731";
+    client->options.default_port = strdup(client->options.default_port);
+    client->cache_fd = -1;
+
+    client->epfd = epoll_create1(EPOLL_CLOEXEC);
+    client->resolved_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    client->conns = calloc(client->options.concurrency, sizeof(struct Conn));
+    // host lookups are told apart from connections by having no attempt
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (client->epfd < 0 || client->resolved_fd < 0 || !client->conns || !client->options.default_port ||
+        epoll_ctl(client->epfd, EPOLL_CTL_ADD, client->resolved_fd, &ev) < 0) {
+        int saved = errno;
+        pronoun_free(client);
+        errno = saved;
+        return NULL;
+    }
+    for (int i = 0; i < client->options.concurrency; i++) {
+        client->conns[i].client = client;
+        client->conns[i].fd = -1;
+    }
+
+    // without a usable cache directory, everyone is looked up as if there were no cache
+    if (client->options.cache_ttl > 0)
+        cache_open(client);
+    return client;
+}
+
+void pronoun_free(struct pronoun_client *client) {
+    if (!client)
+        return;
+    if (client->conns) {
+        for (int i = 0; i < client->options.concurrency; i++) {
+            conn_close(&client->conns[i]);
+            free(client->conns[i].attempts);
+        }
+    }
+    for (int i = 0; i < client->target_count; i++)
+        target_free(&client->targets[i]);
+    free(client->targets);
+    free(client->conns);
+    free((char *)client->options.default_port);
+    cache_close(client);
+    if (client->epfd >= 0)
+        close(client->epfd);
+    if (client->resolved_fd >= 0)
+        close(client->resolved_fd);
+    free(client);
+}
+
+bool pronoun_add(struct pronoun_client *client, const char *spec, void *data) {
+    // once everything added has been returned, start over rather than growing for ever
+    if (client->target_count && client->first_pending == client->target_count) {
+        for (int i = 0; i < client->target_count; i++)
+            target_free(&client->targets[i]);
+        client->target_count = client->first_pending = 0;
+    }
+
+    if (client->target_count == client->target_size) {
+        int size = client->target_size ? client->target_size * 2 : 16;
+        struct Target *grown = realloc(client->targets, size * sizeof(struct Target));
+        if (!grown)
+            return false;
+        client->targets = grown;
+        client->target_size = size;
+    }
+    struct Target *target = &client->targets[client->target_count];
+    if (!parse_target(target, spec, client->options.default_port)) {
+        target_free(target);
+        return false;
+    }
+    target->data = data;
+    client->target_count++;
+    if (client->cache && !client->options.refresh)
+        cache_lookup(client, target);
+    return true;
+}
+
+int pronoun_fd(const struct pronoun_client *client) {
+    return client->epfd;
+}
+
+int pronoun_timeout(const struct pronoun_client *client) {
+    bool idle = false;
+    int timeout = -1;
+    uint64_t now = now_ms();
+    for (int c = 0; c < client->options.concurrency; c++) {
+        const struct Conn *conn = &client->conns[c];
+        if (!conn->count) {
+            idle = true;
+            continue;
+        }
+        uint64_t until = conn_due(conn);
+        int left = until > now ? (int)(until - now) : 0;
+        if (timeout < 0 || left < timeout)
+            timeout = left;
+    }
+    // users waiting for a connection that's free, or finished and not yet returned, need processing now
+    for (int i = client->first_pending; i < client->target_count; i++) {
+        if ((idle && !client->targets[i].queued) || (client->targets[i].done && !client->targets[i].returned))
+            return 0;
+    }
+    return timeout;
+}
+
+void pronoun_process(struct pronoun_client *client) {
+    // fill idle connections with whoever is next; targets handed back by a fall back are picked up again here
+    int next = client->first_pending;
+    for (int c = 0; c < client->options.concurrency; c++) {
+        if (client->conns[c].count)
+            continue;
+        next = next_waiting(client, next);
+        if (next < 0)
+            break;
+        conn_start(&client->conns[c], next);
+    }
+
+    struct epoll_event events[64];
+    int n = epoll_wait(client->epfd, events, 64, 0);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr) {
+            conn_event(events[i].data.ptr, events[i].events);
+            continue;
+        }
+        uint64_t finished;
+        if (read(client->resolved_fd, &finished, sizeof(finished)) < 0) {
+            // already read, with the lookup it was for picked up below
+        }
+        for (int c = 0; c < client->options.concurrency; c++) {
+            struct Conn *conn = &client->conns[c];
+            if (conn->resolve && __atomic_load_n(&conn->resolve->done, __ATOMIC_ACQUIRE))
+                conn_resolved(conn);
+        }
+    }
+
+    uint64_t now = now_ms();
+    for (int c = 0; c < client->options.concurrency; c++) {
+        if (client->conns[c].count)
+            conn_timers(&client->conns[c], now);
+    }
+}
+
+bool pronoun_next(struct pronoun_client *client, struct pronoun_result *result) {
+    for (int i = client->first_pending; i < client->target_count; i++) {
+        struct Target *target = &client->targets[i];
+        if (target->returned)
+            continue;
+        if (!target->done) {
+            if (client->options.unordered)
+                continue;
+            return false;
+        }
+
+        target->returned = true;
+        while (client->first_pending < client->target_count && client->targets[client->first_pending].returned)
+            client->first_pending++;
+        if (client->cache && !target->cached && !target->error)
+            cache_store(client, target);
+        *result = (struct pronoun_result){
+            .spec = target->spec,
+            .reply = target->reply,
+            .error = target->error,
+            .cached = target->cached,
+            .data = target->data,
+        };
+        return true;
+    }
+    return false;
+}
+
+bool pronoun_pending(const struct pronoun_client *client) {
+    return client->first_pending < client->target_count;
+}
+
+bool pronoun_wait(struct pronoun_client *client, struct pronoun_result *result) {
+    while (pronoun_pending(client)) {
+        if (pronoun_next(client, result))
+            return true;
+        struct pollfd pfd = {.fd = client->epfd, .events = POLLIN};
+        int timeout = pronoun_timeout(client);
+        if (timeout != 0)
+            poll(&pfd, 1, timeout);
+        pronoun_process(client);
+    }
+    return false;
+}
+
+char *pronoun_lookup(const char *spec, const struct pronoun_options *options, const char **error) {
+    struct pronoun_client *client = pronoun_new(options);
+    if (!client) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    if (!pronoun_add(client, spec, NULL)) {
+        *error = "expected <username|uid>@<hostname>[:<port>]";
+        pronoun_free(client);
+        return NULL;
+    }
+
+    char *reply = NULL;
+    struct pronoun_result result;
+    if (pronoun_wait(client, &result)) {
+        *error = result.error;
+        if (result.reply && !(reply = strdup(result.reply)))
+            *error = "out of memory";
+    }
+    pronoun_free(client);
+    return reply;
+}
@@ -0,0 +1,73 @@
+/*
+* libpronoun.h
+* client library for pronound
+* looks up the pronouns of users from pronound daemons, many at once, either blocking or driven from the caller's
+* own event loop
+*
+* pronound is free software distributed under GPLv3
+*/
+
+#ifndef LIBPRONOUN_H
+#define LIBPRONOUN_H
+
+#include <stdbool.h>
+
+/*
+ * options for a client; zero for any of them means the default
+ * users on the same host are asked for over one connection, a line each, so a client with many users to look up makes
+ * few connections, and the timeouts cover the connection, and so every user on it
+ */
+struct pronoun_options {
+    int concurrency;          // connections open at once, 16 by default
+    double timeout;           // seconds a connection may take, 10 by default
+    double connect_timeout;   // seconds it may take to connect, no more than timeout by default
+    double read_timeout;      // seconds it may go without receiving anything once connected, ditto
+    const char *default_port; // for users given without a port, "731" by default
+    long cache_ttl;           // seconds replies are cached on disk for, none by default
+    bool refresh;             // ignore cached replies, but still cache new ones
+    bool unordered;           // return results as they come, rather than in the order users were added
+};
+
+struct pronoun_result {
+    const char *spec;  // as given to pronoun_add
+    const char *reply; // the daemon's reply, a line ending in a newline, or NULL if the lookup failed
+    const char *error; // why the lookup failed, or NULL
+    bool cached;       // the reply came from the cache
+    void *data;        // as given to pronoun_add
+};
+
+struct pronoun_client;
+
+/*
+ * a client, NULL with errno set if it can't be made; not safe to share between threads, and results returned by it
+ * stay valid until the next call on it
+ */
+struct pronoun_client *pronoun_new(const struct pronoun_options *options);
+void pronoun_free(struct pronoun_client *client);
+
+// look up a user, given as user@host[:port] or user@[v6 address]:port; false if it isn't one or there's no memory
+bool pronoun_add(struct pronoun_client *client, const char *spec, void *data);
+
+/*
+ * driving a client from another event loop
+ * wait for pronoun_fd to be readable, or for pronoun_timeout milliseconds (-1 for no timeout), whichever is first,
+ * then call pronoun_process, and collect what has finished with pronoun_next
+ */
+int pronoun_fd(const struct pronoun_client *client);
+int pronoun_timeout(const struct pronoun_client *client);
+void pronoun_process(struct pronoun_client *client);
+bool pronoun_next(struct pronoun_client *client, struct pronoun_result *result);
+
+// whether any users added are yet to be returned by pronoun_next or pronoun_wait
+bool pronoun_pending(const struct pronoun_client *client);
+
+// block until the next result, false once there are none left
+bool pronoun_wait(struct pronoun_client *client, struct pronoun_result *result);
+
+/*
+ * look up one user, blocking; returns the reply, to be freed by the caller, or NULL with error set to why not
+ * options may be NULL for the defaults
+ */
+char *pronoun_lookup(const char *spec, const struct pronoun_options *options, const char **error);
+
+#endif
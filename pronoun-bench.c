@@ -0,0 +1,999 @@
+/*
+* pronoun-bench.c
+* load generator for pronound
+* keeps many queries in flight against a daemon, picking users with a Zipfian distribution, and reports the
+* throughput and latency percentiles seen
+*
+* pronound is free software distributed under GPLv3
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+enum Mode {
+    MODE_SINGLE,    // a connection per query, as pronoun does
+    MODE_KEEPALIVE, // queries pipelined over long-lived connections
+    MODE_UDP,       // a datagram per query
+};
+
+const char *mode_names[] = {"single", "keepalive", "udp"};
+
+struct Options {
+    enum Mode mode;
+    int connections;  // in flight at once, across all threads
+    int threads;
+    int depth;        // queries pipelined per connection in keepalive mode
+    double duration;  // seconds to run for, if requests is 0
+    long requests;    // queries to send in total, 0 to run for duration
+    double zipf;      // exponent; 0 picks users uniformly
+    int timeout_ms;   // a query unanswered for this long counts as an error
+    char **users;
+    int user_count;
+    struct addrinfo *addr;
+};
+
+struct Options options = {.mode = MODE_SINGLE,
+                          .connections = 64,
+                          .threads = 1,
+                          .depth = 8,
+                          .duration = 10,
+                          .zipf = 1.0,
+                          .timeout_ms = 1000};
+
+double *zipf_cdf; // cumulative probability of picking users 0..i, users are ranked in the order given
+
+#define MAX_DEPTH 64
+
+enum ConnState {
+    CONN_IDLE,       // no socket, start a new one
+    CONN_CONNECTING,
+    CONN_OPEN,
+};
+
+struct Conn {
+    int fd;
+    enum ConnState state;
+    char out[MAX_DEPTH * 64];
+    size_t out_len, out_sent;
+    char in[1024];
+    size_t in_len;
+    uint64_t sent_at[MAX_DEPTH]; // ring of send times of the queries awaiting replies, oldest first
+    int head, pending;
+};
+
+struct Sample {
+    uint64_t done;    // nanoseconds into the run the reply came in
+    uint64_t latency; // nanoseconds
+};
+
+struct Thread {
+    pthread_t thread;
+    int epfd;
+    struct Conn *conns;
+    int conn_count;
+    uint64_t rng;
+    long budget;   // queries left to send, -1 for no limit
+    struct Sample *samples;
+    size_t sample_count, sample_size;
+    uint64_t errors;
+    uint64_t bytes;
+};
+
+bool stopping = false; // set by the main thread once the duration is up
+uint64_t started_ns;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, each thread has its own state
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+bool zipf_init() {
+    zipf_cdf = malloc(options.user_count * sizeof(double));
+    if (!zipf_cdf)
+        return false;
+    double total = 0;
+    for (int i = 0; i < options.user_count; i++) {
+        total += 1.0 / pow(i + 1, options.zipf);
+        zipf_cdf[i] = total;
+    }
+    for (int i = 0; i < options.user_count; i++)
+        zipf_cdf[i] /= total;
+    return true;
+}
+
+const char *pick_user(struct Thread *t) {
+    double p = (next_random(&t->rng) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = options.user_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return options.users[lo];
+}
+
+void record(struct Thread *t, uint64_t sent) {
+    if (t->sample_count == t->sample_size) {
+        size_t size = t->sample_size ? t->sample_size * 2 : 4096;
+        struct Sample *samples = realloc(t->samples, size * sizeof(struct Sample));
+        if (!samples)
+            return;
+        t->samples = samples;
+        t->sample_size = size;
+    }
+    uint64_t now = now_ns();
+    t->samples[t->sample_count++] = (struct Sample){now - started_ns, now - sent};
+}
+
+// take a query from the budget, false once it's spent or the run is over
+bool take_query(struct Thread *t) {
+    if (__atomic_load_n(&stopping, __ATOMIC_RELAXED) || t->budget == 0)
+        return false;
+    if (t->budget > 0)
+        t->budget--;
+    return true;
+}
+
+void conn_close(struct Thread *t, struct Conn *c, bool failed) {
+    if (failed)
+        t->errors += c->pending;
+    if (c->fd >= 0) {
+        epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = CONN_IDLE;
+    c->out_len = c->out_sent = 0;
+    c->in_len = 0;
+    c->head = c->pending = 0;
+}
+
+// queue up queries until the connection has as many in flight as it should
+void conn_fill(struct Thread *t, struct Conn *c) {
+    int want = options.mode == MODE_KEEPALIVE ? options.depth : 1;
+    while (c->pending < want && take_query(t)) {
+        const char *user = pick_user(t);
+        size_t len = strlen(user);
+        if (options.mode == MODE_UDP) {
+            // a datagram goes out at once, and only one is in flight per socket
+            if (send(c->fd, user, len, 0) < 0) {
+                t->errors++;
+                return;
+            }
+        } else {
+            if (c->out_len + len + 1 > sizeof(c->out))
+                break;
+            memcpy(c->out + c->out_len, user, len);
+            c->out[c->out_len + len] = '\n';
+            c->out_len += len + 1;
+        }
+        c->sent_at[(c->head + c->pending) % MAX_DEPTH] = now_ns();
+        c->pending++;
+    }
+}
+
+void conn_start(struct Thread *t, struct Conn *c) {
+    int type = options.mode == MODE_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    c->fd = socket(options.addr->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        t->errors++;
+        return;
+    }
+    if (connect(c->fd, options.addr->ai_addr, options.addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        t->errors++;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->state = options.mode == MODE_UDP ? CONN_OPEN : CONN_CONNECTING;
+    // edge triggered: sockets are always read and written until they would block
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c};
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (c->state == CONN_OPEN)
+        conn_fill(t, c);
+}
+
+bool conn_flush(struct Conn *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN;
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return true;
+}
+
+// a reply came in for the oldest query in flight
+void conn_answered(struct Thread *t, struct Conn *c, size_t len) {
+    record(t, c->sent_at[c->head]);
+    t->bytes += len;
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->pending--;
+}
+
+void conn_readable(struct Thread *t, struct Conn *c) {
+    if (options.mode == MODE_UDP) {
+        char buf[512];
+        ssize_t n;
+        while ((n = recv(c->fd, buf, sizeof(buf), 0)) >= 0) {
+            if (c->pending)
+                conn_answered(t, c, n);
+        }
+        conn_fill(t, c);
+        return;
+    }
+
+    while (true) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                conn_close(t, c, true);
+            return;
+        }
+        if (n == 0) {
+            // an unterminated reply before the close still counts, pronound always closes after a reply in single mode
+            if (c->in_len && c->pending)
+                conn_answered(t, c, c->in_len);
+            conn_close(t, c, true);
+            return;
+        }
+        c->in_len += n;
+
+        char *line;
+        while ((line = memchr(c->in, '\n', c->in_len))) {
+            size_t len = line - c->in + 1;
+            if (c->pending)
+                conn_answered(t, c, len);
+            memmove(c->in, c->in + len, c->in_len - len);
+            c->in_len -= len;
+        }
+        if (c->in_len == sizeof(c->in))
+            c->in_len = 0; // a reply too long to be real, drop it
+        if (options.mode == MODE_SINGLE && c->pending == 0) {
+            conn_close(t, c, false);
+            return;
+        }
+    }
+}
+
+void conn_event(struct Thread *t, struct Conn *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))) {
+            t->errors++;
+            conn_close(t, c, false);
+            return;
+        }
+        c->state = CONN_OPEN;
+        conn_fill(t, c);
+    }
+    if (events & EPOLLIN)
+        conn_readable(t, c);
+    if (c->fd >= 0 && options.mode != MODE_UDP) {
+        conn_fill(t, c);
+        if (!conn_flush(c))
+            conn_close(t, c, true);
+    }
+}
+
+// drop queries that have waited too long, and their connection with them, as replies come back in order
+void expire(struct Thread *t) {
+    uint64_t limit = now_ns() - (uint64_t)options.timeout_ms * 1000000;
+    for (int i = 0; i < t->conn_count; i++) {
+        struct Conn *c = &t->conns[i];
+        if (c->fd >= 0 && c->pending && c->sent_at[c->head] < limit) {
+            if (options.mode == MODE_UDP) {
+                // a lost datagram, try another
+                t->errors++;
+                c->head = (c->head + 1) % MAX_DEPTH;
+                c->pending--;
+                conn_fill(t, c);
+            } else {
+                conn_close(t, c, true);
+            }
+        }
+    }
+}
+
+void *run(void *arg) {
+    struct Thread *t = arg;
+    struct epoll_event events[64];
+    uint64_t last_expiry = now_ns();
+
+    while (true) {
+        bool busy = false;
+        for (int i = 0; i < t->conn_count; i++) {
+            struct Conn *c = &t->conns[i];
+            if (c->state == CONN_IDLE && !__atomic_load_n(&stopping, __ATOMIC_RELAXED) && t->budget != 0)
+                conn_start(t, c);
+            if (c->fd >= 0)
+                busy = true;
+        }
+        if (!busy)
+            break;
+
+        int n = epoll_wait(t->epfd, events, 64, 10);
+        for (int i = 0; i < n; i++)
+            conn_event(t, events[i].data.ptr, events[i].events);
+
+        uint64_t now = now_ns();
+        if (now - last_expiry > 10000000) {
+            expire(t);
+            last_expiry = now;
+        }
+        // once no more queries will be sent, idle connections have nothing left to wait for
+        if (__atomic_load_n(&stopping, __ATOMIC_RELAXED) || t->budget == 0) {
+            for (int i = 0; i < t->conn_count; i++) {
+                if (t->conns[i].fd >= 0 && t->conns[i].pending == 0)
+                    conn_close(t, &t->conns[i], false);
+            }
+        }
+    }
+    return NULL;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(const uint64_t *sorted, size_t count, double p) {
+    if (!count)
+        return 0;
+    size_t i = (size_t)ceil(p / 100 * count);
+    return sorted[i ? i - 1 : 0] / 1e6;
+}
+
+int compare_done(const void *a, const void *b) {
+    uint64_t x = ((const struct Sample *)a)->done, y = ((const struct Sample *)b)->done;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * results
+ * besides the totals, the run is cut into INTERVALS slices, and the throughput and percentiles of each slice are kept
+ * as samples, so that runs can be compared with a significance test rather than by eye
+ */
+#define INTERVALS 10
+#define PERCENTILES 3
+
+const char *percentile_names[PERCENTILES] = {"p50_ms", "p99_ms", "p999_ms"};
+const double percentile_points[PERCENTILES] = {50, 99, 99.9};
+
+struct Summary {
+    double elapsed;
+    size_t replies;
+    uint64_t errors, bytes;
+    double qps;
+    double percentiles[PERCENTILES];
+    double max_ms;
+    int intervals;
+    double interval_qps[INTERVALS];
+    double interval_percentiles[PERCENTILES][INTERVALS];
+    long rss_kb, peak_rss_kb; // of the daemon, if its pid was given, else -1
+};
+
+// summarise samples, which are sorted by time in the process
+bool summarise(struct Sample *samples, size_t count, struct Summary *summary) {
+    uint64_t *latencies = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!latencies)
+        return false;
+
+    qsort(samples, count, sizeof(struct Sample), compare_done);
+    uint64_t span = (uint64_t)(summary->elapsed * 1e9) / INTERVALS + 1;
+    summary->intervals = 0;
+    size_t from = 0;
+    for (int i = 0; i < INTERVALS; i++) {
+        size_t to = from;
+        while (to < count && samples[to].done < (i + 1) * span)
+            to++;
+        for (size_t j = from; j < to; j++)
+            latencies[j - from] = samples[j].latency;
+        qsort(latencies, to - from, sizeof(uint64_t), compare_u64);
+        summary->interval_qps[i] = (to - from) / (span / 1e9);
+        for (int p = 0; p < PERCENTILES; p++)
+            summary->interval_percentiles[p][i] = percentile(latencies, to - from, percentile_points[p]);
+        summary->intervals++;
+        from = to;
+    }
+
+    for (size_t j = 0; j < count; j++)
+        latencies[j] = samples[j].latency;
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    summary->replies = count;
+    summary->qps = count / summary->elapsed;
+    for (int p = 0; p < PERCENTILES; p++)
+        summary->percentiles[p] = percentile(latencies, count, percentile_points[p]);
+    summary->max_ms = percentile(latencies, count, 100);
+    free(latencies);
+    return true;
+}
+
+// resident and peak resident memory of a process, from /proc
+void read_rss(pid_t pid, long *rss_kb, long *peak_kb) {
+    *rss_kb = *peak_kb = -1;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        sscanf(line, "VmRSS: %ld", rss_kb);
+        sscanf(line, "VmHWM: %ld", peak_kb);
+    }
+    fclose(file);
+}
+
+void json_metric(FILE *out, const char *name, double value, const char *better, const double *samples, int count,
+                 bool last) {
+    fprintf(out, "    \"%s\": {\"value\": %.6g, \"better\": \"%s\", \"samples\": [", name, value, better);
+    for (int i = 0; i < count; i++)
+        fprintf(out, "%s%.6g", i ? ", " : "", samples[i]);
+    fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+bool write_json(const char *path, const struct Summary *summary) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(out, "{\n  \"tool\": \"pronoun-bench\",\n");
+    fprintf(out, "  \"mode\": \"%s\", \"connections\": %d, \"threads\": %d, \"depth\": %d, \"users\": %d, "
+                 "\"zipf\": %g,\n",
+            mode_names[options.mode], options.connections, options.threads, options.depth, options.user_count,
+            options.zipf);
+    fprintf(out, "  \"elapsed\": %.3f, \"replies\": %zu, \"errors\": %llu, \"bytes\": %llu,\n", summary->elapsed,
+            summary->replies, (unsigned long long)summary->errors, (unsigned long long)summary->bytes);
+    fprintf(out, "  \"metrics\": {\n");
+    json_metric(out, "qps", summary->qps, "higher", summary->interval_qps, summary->intervals, false);
+    for (int p = 0; p < PERCENTILES; p++)
+        json_metric(out, percentile_names[p], summary->percentiles[p], "lower", summary->interval_percentiles[p],
+                    summary->intervals, false);
+    double error_rate = summary->replies + summary->errors ? (double)summary->errors / (summary->replies + summary->errors) : 0;
+    bool rss = summary->rss_kb >= 0;
+    json_metric(out, "error_rate", error_rate, "lower", NULL, 0, !rss);
+    if (rss) {
+        json_metric(out, "rss_kb", summary->rss_kb, "lower", NULL, 0, false);
+        json_metric(out, "peak_rss_kb", summary->peak_rss_kb, "lower", NULL, 0, true);
+    }
+    fprintf(out, "  }\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return true;
+}
+
+/*
+ * comparing runs
+ * just enough of a JSON reader for the "metrics" object written above (and by pronound-microbench): every metric
+ * with samples in both runs gets a Welch's t-test, and a change for the worse is flagged as a regression if it is
+ * both significant and larger than the threshold; metrics without samples are flagged on the threshold alone
+ */
+#define MAX_METRICS 64
+#define MAX_SAMPLES 256
+
+struct Metric {
+    char name[64];
+    double value;
+    bool higher_better;
+    double samples[MAX_SAMPLES];
+    int count;
+};
+
+struct Run {
+    struct Metric metrics[MAX_METRICS];
+    int count;
+};
+
+void json_space(const char **p) {
+    while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r')
+        (*p)++;
+}
+
+bool json_string(const char **p, char *out, size_t size) {
+    json_space(p);
+    if (**p != '"')
+        return false;
+    (*p)++;
+    size_t len = 0;
+    while (**p && **p != '"') {
+        if (**p == '\\' && (*p)[1])
+            (*p)++;
+        if (len + 1 < size)
+            out[len++] = **p;
+        (*p)++;
+    }
+    if (**p != '"')
+        return false;
+    (*p)++;
+    out[len] = '\0';
+    return true;
+}
+
+// skip over any value, nested or not
+bool json_skip(const char **p) {
+    json_space(p);
+    if (**p == '"') {
+        char scratch[8];
+        return json_string(p, scratch, sizeof(scratch));
+    }
+    if (**p == '{' || **p == '[') {
+        int depth = 0;
+        bool in_string = false;
+        for (; **p; (*p)++) {
+            if (in_string) {
+                if (**p == '\\' && (*p)[1])
+                    (*p)++;
+                else if (**p == '"')
+                    in_string = false;
+            } else if (**p == '"') {
+                in_string = true;
+            } else if (**p == '{' || **p == '[') {
+                depth++;
+            } else if ((**p == '}' || **p == ']') && --depth == 0) {
+                (*p)++;
+                return true;
+            }
+        }
+        return false;
+    }
+    while (**p && **p != ',' && **p != '}' && **p != ']')
+        (*p)++;
+    return true;
+}
+
+bool json_metric_read(const char **p, struct Metric *metric) {
+    json_space(p);
+    if (**p != '{')
+        return false;
+    (*p)++;
+    while (true) {
+        char key[32];
+        json_space(p);
+        if (**p == '}') {
+            (*p)++;
+            return true;
+        }
+        if (!json_string(p, key, sizeof(key)))
+            return false;
+        json_space(p);
+        if (**p != ':')
+            return false;
+        (*p)++;
+        json_space(p);
+        if (strcmp(key, "value") == 0) {
+            metric->value = strtod(*p, (char **)p);
+        } else if (strcmp(key, "better") == 0) {
+            char better[16];
+            if (!json_string(p, better, sizeof(better)))
+                return false;
+            metric->higher_better = strcmp(better, "higher") == 0;
+        } else if (strcmp(key, "samples") == 0 && **p == '[') {
+            (*p)++;
+            while (true) {
+                json_space(p);
+                if (**p == ']') {
+                    (*p)++;
+                    break;
+                }
+                double sample = strtod(*p, (char **)p);
+                if (metric->count < MAX_SAMPLES)
+                    metric->samples[metric->count++] = sample;
+                json_space(p);
+                if (**p == ',')
+                    (*p)++;
+                else if (**p != ']')
+                    return false;
+            }
+        } else if (!json_skip(p)) {
+            return false;
+        }
+        json_space(p);
+        if (**p == ',')
+            (*p)++;
+    }
+}
+
+bool read_run(const char *path, struct Run *run) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char *text = NULL;
+    size_t size = 0;
+    ssize_t len = getdelim(&text, &size, '\0', file);
+    fclose(file);
+    if (len < 0) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+
+    bool ok = false;
+    const char *p = strstr(text, "\"metrics\"");
+    if (p && (p = strchr(p, '{'))) {
+        p++;
+        run->count = 0;
+        while (true) {
+            json_space(&p);
+            if (*p == '}') {
+                ok = true;
+                break;
+            }
+            struct Metric *metric = &run->metrics[run->count];
+            memset(metric, 0, sizeof(*metric));
+            if (!json_string(&p, metric->name, sizeof(metric->name)))
+                break;
+            json_space(&p);
+            if (*p++ != ':' || !json_metric_read(&p, metric))
+                break;
+            if (run->count < MAX_METRICS)
+                run->count++;
+            json_space(&p);
+            if (*p == ',')
+                p++;
+        }
+    }
+    free(text);
+    if (!ok)
+        fprintf(stderr, "%s doesn't look like pronoun-bench or pronound-microbench output\n", path);
+    return ok;
+}
+
+// continued fraction for the regularised incomplete beta function, after Numerical Recipes' betacf
+double beta_fraction(double a, double b, double x) {
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    if (fabs(d) < 1e-300)
+        d = 1e-300;
+    d = 1 / d;
+    double h = d;
+    for (int m = 1; m <= 200; m++) {
+        double aa = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+        d = 1 + aa * d;
+        c = 1 + aa / c;
+        d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+        c = fabs(c) < 1e-300 ? 1e-300 : c;
+        h *= d * c;
+        aa = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+        d = 1 + aa * d;
+        c = 1 + aa / c;
+        d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+        c = fabs(c) < 1e-300 ? 1e-300 : c;
+        double delta = d * c;
+        h *= delta;
+        if (fabs(delta - 1) < 1e-12)
+            break;
+    }
+    return h;
+}
+
+double incomplete_beta(double a, double b, double x) {
+    if (x <= 0)
+        return 0;
+    if (x >= 1)
+        return 1;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+    if (x < (a + 1) / (a + b + 2))
+        return front * beta_fraction(a, b, x) / a;
+    return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+void mean_variance(const double *samples, int count, double *mean, double *variance) {
+    double sum = 0, squares = 0;
+    for (int i = 0; i < count; i++)
+        sum += samples[i];
+    *mean = sum / count;
+    for (int i = 0; i < count; i++)
+        squares += (samples[i] - *mean) * (samples[i] - *mean);
+    *variance = count > 1 ? squares / (count - 1) : 0;
+}
+
+// two-sided p-value of Welch's t-test, 1 if there's too little to go on
+double welch_p(const struct Metric *a, const struct Metric *b) {
+    if (a->count < 2 || b->count < 2)
+        return 1;
+    double mean_a, var_a, mean_b, var_b;
+    mean_variance(a->samples, a->count, &mean_a, &var_a);
+    mean_variance(b->samples, b->count, &mean_b, &var_b);
+    double se_a = var_a / a->count, se_b = var_b / b->count;
+    if (se_a + se_b == 0)
+        return mean_a == mean_b ? 1 : 0;
+    double t = (mean_a - mean_b) / sqrt(se_a + se_b);
+    double df = (se_a + se_b) * (se_a + se_b) /
+                (se_a * se_a / (a->count - 1) + se_b * se_b / (b->count - 1));
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+int compare_main(int argc, char *argv[]) {
+    double alpha = 0.05, threshold = 2;
+    int opt;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "a:t:")) != -1) {
+        switch (opt) {
+        case 'a':
+            alpha = atof(optarg);
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: pronoun-bench compare [-a alpha] [-t threshold%%] <baseline.json> <new.json>\n");
+            return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: pronoun-bench compare [-a alpha] [-t threshold%%] <baseline.json> <new.json>\n");
+        return 2;
+    }
+
+    static struct Run baseline, candidate;
+    if (!read_run(argv[optind], &baseline) || !read_run(argv[optind + 1], &candidate))
+        return 2;
+
+    int regressions = 0;
+    printf("%-28s %14s %14s %9s %9s\n", "metric", "baseline", "new", "change", "p");
+    for (int i = 0; i < baseline.count; i++) {
+        const struct Metric *a = &baseline.metrics[i];
+        const struct Metric *b = NULL;
+        for (int j = 0; j < candidate.count && !b; j++) {
+            if (strcmp(candidate.metrics[j].name, a->name) == 0)
+                b = &candidate.metrics[j];
+        }
+        if (!b)
+            continue;
+
+        double change = a->value ? 100 * (b->value - a->value) / fabs(a->value) : b->value ? 100 : 0;
+        double worse = a->higher_better ? -change : change;
+        bool sampled = a->count >= 2 && b->count >= 2;
+        double p = welch_p(a, b);
+        bool regressed = worse > threshold && (!sampled || p < alpha);
+        bool improved = worse < -threshold && (!sampled || p < alpha);
+        regressions += regressed;
+
+        char p_text[16] = "-";
+        if (sampled)
+            snprintf(p_text, sizeof(p_text), "%.4f", p);
+        printf("%-28s %14.6g %14.6g %+8.1f%% %9s%s\n", a->name, a->value, b->value, change, p_text,
+               regressed ? "  REGRESSION" : improved ? "  improved" : "");
+    }
+    if (regressions)
+        printf("%d regression%s (more than %g%% worse, p < %g)\n", regressions, regressions == 1 ? "" : "s", threshold,
+               alpha);
+    return regressions ? 1 : 0;
+}
+
+bool load_users(const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    int size = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0])
+            continue;
+        if (options.user_count == size) {
+            size = size ? size * 2 : 1024;
+            char **users = realloc(options.users, size * sizeof(char *));
+            if (!users)
+                return false;
+            options.users = users;
+        }
+        options.users[options.user_count++] = strdup(line);
+    }
+    if (file != stdin)
+        fclose(file);
+    return true;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-m single|keepalive|udp] [-c connections] [-t threads] [-p depth] [-d seconds] [-n requests]\n"
+            "       [-z exponent] [-T timeout_ms] [-u userfile] [-j results.json] [-P daemon_pid] <host>[:<port>] [user...]\n"
+            "       %s compare [-a alpha] [-t threshold%%] <baseline.json> <new.json>\n",
+            name, name);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "compare") == 0)
+        return compare_main(argc - 1, argv + 1);
+
+    const char *user_file = NULL;
+    const char *json_path = NULL;
+    pid_t daemon_pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:t:p:d:n:z:T:u:j:P:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "single") == 0)
+                options.mode = MODE_SINGLE;
+            else if (strcmp(optarg, "keepalive") == 0)
+                options.mode = MODE_KEEPALIVE;
+            else if (strcmp(optarg, "udp") == 0)
+                options.mode = MODE_UDP;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'p':
+            options.depth = atoi(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'n':
+            options.requests = atol(optarg);
+            break;
+        case 'z':
+            options.zipf = atof(optarg);
+            break;
+        case 'T':
+            options.timeout_ms = atoi(optarg);
+            break;
+        case 'u':
+            user_file = optarg;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        case 'P':
+            daemon_pid = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.connections < 1 || options.threads < 1 || options.depth < 1 || options.depth > MAX_DEPTH) {
+        fprintf(stderr, "connections and threads must be positive, and depth between 1 and %d\n", MAX_DEPTH);
+        return 1;
+    }
+    if (options.threads > options.connections)
+        options.threads = options.connections;
+
+    char *hostname = argv[optind];
+    char *port_str = "731";
+    char *colon = strrchr(hostname, ':');
+    if (colon && !strchr(colon + 1, ']') && strchr(hostname, ':') == colon) {
+        *colon = '\0';
+        port_str = colon + 1;
+    }
+
+    if (user_file && !load_users(user_file))
+        return 1;
+    for (int i = optind + 1; i < argc; i++) {
+        char **users = realloc(options.users, (options.user_count + 1) * sizeof(char *));
+        if (!users)
+            return 1;
+        options.users = users;
+        options.users[options.user_count++] = argv[i];
+    }
+    if (options.user_count == 0) {
+        fprintf(stderr, "no users to query, give some or use -u\n");
+        return 1;
+    }
+    if (!zipf_init())
+        return 1;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = options.mode == MODE_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    int err = getaddrinfo(hostname, port_str, &hints, &options.addr);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(err));
+        return 1;
+    }
+
+    struct Thread *threads = calloc(options.threads, sizeof(struct Thread));
+    if (!threads)
+        return 1;
+    uint64_t started = now_ns();
+    started_ns = started;
+    for (int i = 0; i < options.threads; i++) {
+        struct Thread *t = &threads[i];
+        t->conn_count = options.connections / options.threads + (i < options.connections % options.threads);
+        t->conns = calloc(t->conn_count, sizeof(struct Conn));
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (!t->conns || t->epfd < 0) {
+            fprintf(stderr, "could not set up thread %d\n", i);
+            return 1;
+        }
+        for (int j = 0; j < t->conn_count; j++) {
+            t->conns[j].fd = -1;
+            t->conns[j].state = CONN_IDLE;
+        }
+        t->rng = started ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+        t->budget = options.requests ? options.requests / options.threads + (i < options.requests % options.threads) : -1;
+        if (pthread_create(&t->thread, NULL, run, t) != 0) {
+            fprintf(stderr, "could not start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    if (!options.requests) {
+        struct timespec ts = {(time_t)options.duration, (long)((options.duration - (time_t)options.duration) * 1e9)};
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    }
+
+    struct Summary summary = {0};
+    size_t count = 0;
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        count += threads[i].sample_count;
+        summary.errors += threads[i].errors;
+        summary.bytes += threads[i].bytes;
+    }
+    summary.elapsed = (now_ns() - started) / 1e9;
+
+    struct Sample *samples = malloc((count ? count : 1) * sizeof(struct Sample));
+    if (!samples)
+        return 1;
+    size_t offset = 0;
+    for (int i = 0; i < options.threads; i++) {
+        memcpy(samples + offset, threads[i].samples, threads[i].sample_count * sizeof(struct Sample));
+        offset += threads[i].sample_count;
+    }
+    if (!summarise(samples, count, &summary))
+        return 1;
+    summary.rss_kb = summary.peak_rss_kb = -1;
+    if (daemon_pid)
+        read_rss(daemon_pid, &summary.rss_kb, &summary.peak_rss_kb);
+
+    // with the JSON going to stdout, the summary goes to stderr instead
+    FILE *out = json_path && strcmp(json_path, "-") == 0 ? stderr : stdout;
+    fprintf(out, "mode %s, %d connections over %d threads, %d users (zipf %.2f)\n", mode_names[options.mode],
+            options.connections, options.threads, options.user_count, options.zipf);
+    fprintf(out, "%zu replies, %llu errors in %.2fs: %.0f queries/s, %.2f MB/s\n", count,
+            (unsigned long long)summary.errors, summary.elapsed, summary.qps, summary.bytes / summary.elapsed / 1e6);
+    fprintf(out, "latency ms: p50 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n", summary.percentiles[0],
+            summary.percentiles[1], summary.percentiles[2], summary.max_ms);
+    if (summary.rss_kb >= 0)
+        fprintf(out, "daemon memory: %ld kB resident, %ld kB at peak\n", summary.rss_kb, summary.peak_rss_kb);
+    if (json_path && !write_json(json_path, &summary))
+        return 1;
+    freeaddrinfo(options.addr);
+    return summary.errors && !count ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+* pronoun-fixture.c
+* synthetic user base for pronound
+* writes a passwd file and a tree of home directories, some with pronouns files, some with empty ones and some
+* without, and a pronound.conf serving them, so the daemon can be benchmarked without root or real accounts
+*
+* pronound is free software distributed under GPLv3
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+
+// roughly how often each is seen in the wild, most common first
+const char *pronoun_sets[] = {"she/her", "he/him", "they/them", "she/they", "he/they", "any/all", "xe/xem", "it/its",
+                              "fae/faer", "they/them (ask me)"};
+const int pronoun_weights[] = {30, 30, 20, 6, 6, 3, 2, 1, 1, 1};
+#define PRONOUN_SETS (sizeof(pronoun_sets) / sizeof(pronoun_sets[0]))
+
+uint64_t rng;
+
+// xorshift64*
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+// true with the given chance, in percent
+bool chance(int percent) {
+    return (int)(next_random() % 100) < percent;
+}
+
+const char *pick_pronouns() {
+    int total = 0;
+    for (size_t i = 0; i < PRONOUN_SETS; i++)
+        total += pronoun_weights[i];
+    int n = next_random() % total;
+    for (size_t i = 0; i < PRONOUN_SETS; i++) {
+        n -= pronoun_weights[i];
+        if (n < 0)
+            return pronoun_sets[i];
+    }
+    return pronoun_sets[0];
+}
+
+bool make_dir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n users] [-m missing%%] [-e empty%%] [-x unknown%%] [-s seed] [-p port] <dir>\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    long users = 1000;
+    int missing = 40; // users without a pronouns file
+    int empty = 5;    // users with an empty one
+    int unknown = 5;  // queries in the users list for names that don't exist
+    int port = 7731;
+    rng = 0x2545f4914f6cdd1dULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:e:x:s:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            users = atol(optarg);
+            break;
+        case 'm':
+            missing = atoi(optarg);
+            break;
+        case 'e':
+            empty = atoi(optarg);
+            break;
+        case 'x':
+            unknown = atoi(optarg);
+            break;
+        case 's':
+            rng = strtoull(optarg, NULL, 0) | 1; // xorshift state can't be 0
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || users < 1 || missing + empty > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[PATH_MAX];
+    if (!make_dir(argv[optind]) || !realpath(argv[optind], dir)) {
+        fprintf(stderr, "could not use %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    char path[PATH_MAX + 128];
+    snprintf(path, sizeof(path), "%s/home", dir);
+    if (!make_dir(path))
+        return 1;
+
+    snprintf(path, sizeof(path), "%s/passwd", dir);
+    FILE *passwd = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/users", dir);
+    FILE *list = fopen(path, "w");
+    if (!passwd || !list) {
+        fprintf(stderr, "could not write to %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    long with_file = 0, with_empty = 0;
+    for (long i = 0; i < users; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "user%ld", i);
+        char home[PATH_MAX + 64];
+        snprintf(home, sizeof(home), "%s/home/%s", dir, name);
+        fprintf(passwd, "%s:x:%ld:%ld::%s:/bin/sh\n", name, 100000 + i, 100000 + i, home);
+        if (!make_dir(home))
+            return 1;
+
+        int roll = next_random() % 100;
+        if (roll >= missing) {
+            snprintf(path, sizeof(path), "%s/.pronouns", home);
+            FILE *file = fopen(path, "w");
+            if (!file) {
+                fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+                return 1;
+            }
+            if (roll < missing + empty) {
+                with_empty++;
+            } else {
+                fprintf(file, "%s\n", pick_pronouns());
+                with_file++;
+            }
+            fclose(file);
+        }
+
+        // the users list is in popularity order for pronoun-bench, with a few names nobody has mixed in
+        if (chance(unknown))
+            fprintf(list, "nobody%ld\n", i);
+        fprintf(list, "%s\n", name);
+    }
+    fclose(passwd);
+    fclose(list);
+
+    snprintf(path, sizeof(path), "%s/pronound.conf", dir);
+    FILE *conf = fopen(path, "w");
+    if (!conf) {
+        fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(conf, "port %d\npasswd_file %s/passwd\nfile .pronouns\n", port, dir);
+    fclose(conf);
+
+    printf("%ld users in %s: %ld with pronouns, %ld with an empty file, %ld without one\n", users, dir, with_file,
+           with_empty, users - with_file - with_empty);
+    printf("run pronound -C %s/pronound.conf, and pronoun-bench -u %s/users 127.0.0.1:%d\n", dir, dir, port);
+    return 0;
+}
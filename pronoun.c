@@ -1,7 +1,7 @@
 /*
 * pronoun.c
 * simple pronoun daemon client
-* sends a request to the pronound daemon and receives the pronouns for a user
+* sends requests to pronound daemons and receives the pronouns for users, many at once if asked, through libpronoun
 *
 * pronound is free software distributed under GPLv3
 */
@@ -11,73 +11,132 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <errno.h>
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <username|uid>@<hostname>[:<port>]\n", argv[0]);
-    }
+#include "libpronoun.h"
 
-    char *username_or_uid = strtok(argv[1], "@");
-    char *hostname = strtok(NULL, " ");
-    char *port_str = argv[2] ? argv[2] : "731";
-
-    if (!username_or_uid) {
-        fprintf(stderr, "Username or UID is required\n");
-        return 1;
+void print_result(const struct pronoun_result *result, bool prefix) {
+    if (result->error) {
+        fprintf(stderr, "%s: %s\n", result->spec, result->error);
+        return;
     }
-    if (!hostname) {
-        fprintf(stderr, "Hostname is required\n");
-        return 1;
-    } 
+    if (prefix)
+        printf("%s: ", result->spec);
+    printf("%s", result->reply);
+    size_t len = strlen(result->reply);
+    if (len && result->reply[len - 1] != '\n')
+        printf("\n");
+}
 
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP socket
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j concurrency] [-t timeout] [-T connect_timeout] [-R read_timeout] [-p port] "
+            "[-c cache_ttl] [-n] [-r] <username|uid>@<hostname>[:<port>]...\n", name);
+    fprintf(stderr, "       %s <username|uid>@<hostname> <port>\n", name);
+    fprintf(stderr, "targets are read from stdin, one per line, if none are given or one is -\n");
+}
 
-    if (getaddrinfo(hostname, port_str, &hints, &res) != 0) {
-        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(errno));
+int main(int argc, char *argv[]) {
+    struct pronoun_options options = {.concurrency = 16, .timeout = 10, .default_port = "731"};
+    const char *ttl = getenv("PRONOUN_CACHE_TTL");
+    if (ttl)
+        options.cache_ttl = atol(ttl);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:t:T:R:p:c:nrh")) != -1) {
+        switch (opt) {
+        case 'j':
+            options.concurrency = atoi(optarg);
+            break;
+        case 't':
+            options.timeout = atof(optarg);
+            break;
+        case 'T':
+            options.connect_timeout = atof(optarg);
+            break;
+        case 'R':
+            options.read_timeout = atof(optarg);
+            break;
+        case 'p':
+            options.default_port = optarg;
+            break;
+        case 'c':
+            options.cache_ttl = atol(optarg);
+            break;
+        case 'n':
+            options.cache_ttl = 0;
+            break;
+        case 'r':
+            options.refresh = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.concurrency < 1 || options.timeout <= 0 || options.connect_timeout < 0 || options.read_timeout < 0) {
+        fprintf(stderr, "concurrency and timeouts must be positive\n");
         return 1;
     }
 
-    int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-    if (sockfd < 0) {
-        fprintf(stderr, "socket creation failed: %s\n", strerror(errno));
-        freeaddrinfo(res);
-        return 1;
+    // the original form, user@host port
+    if (argc - optind == 2 && !strchr(argv[optind + 1], '@') && strspn(argv[optind + 1], "0123456789") ==
+        strlen(argv[optind + 1])) {
+        options.default_port = argv[optind + 1];
+        argc--;
     }
 
-    if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-        fprintf(stderr, "connect failed: %s\n", strerror(errno));
-        close(sockfd);
-        freeaddrinfo(res);
+    struct pronoun_client *client = pronoun_new(&options);
+    if (!client) {
+        perror("could not set up");
         return 1;
     }
 
-    freeaddrinfo(res);
+    int count = 0;
+    bool from_stdin = optind == argc;
+    char **specs = argv + optind;
+    int spec_count = argc - optind;
+    char *line = NULL;
+    size_t line_size = 0;
+    for (int i = 0; i < spec_count || from_stdin;) {
+        const char *spec;
+        if (from_stdin) {
+            ssize_t len = getline(&line, &line_size, stdin);
+            if (len < 0) {
+                from_stdin = false;
+                continue;
+            }
+            char *start = line + strspn(line, " \t");
+            start[strcspn(start, " \t\r\n")] = '\0';
+            if (!*start)
+                continue;
+            spec = start;
+        } else {
+            spec = specs[i++];
+            if (strcmp(spec, "-") == 0) {
+                from_stdin = true;
+                continue;
+            }
+        }
 
-    char request[256];
-    snprintf(request, sizeof(request), "%s\n", username_or_uid);
-    if (send(sockfd, request, strlen(request), 0) < 0) {
-        fprintf(stderr, "send failed: %s\n", strerror(errno));
-        close(sockfd);
-        return 1;
+        if (!pronoun_add(client, spec, NULL)) {
+            fprintf(stderr, "%s: expected <username|uid>@<hostname>[:<port>]\n", spec);
+            return 1;
+        }
+        count++;
     }
+    free(line);
 
-    char response[256];
-    ssize_t bytes_received = recv(sockfd, response, sizeof(response) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "recv failed: %s\n", strerror(errno));
-        close(sockfd);
+    if (count == 0) {
+        usage(argv[0]);
         return 1;
     }
-    response[bytes_received] = '\0';
-    printf("%s", response);
-    close(sockfd);
-    return 0;
+
+    // results come in the order the users were given, each as soon as those before it are done
+    int failed = 0;
+    struct pronoun_result result;
+    while (pronoun_wait(client, &result)) {
+        print_result(&result, count > 1);
+        failed += result.error != NULL;
+        fflush(stdout);
+    }
+    pronoun_free(client);
+    return failed ? 1 : 0;
 }
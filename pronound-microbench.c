@@ -0,0 +1,292 @@
+/*
+ * pronound-microbench - microbenchmarks for the per-request path of pronound
+ * builds pronound.c in with its main renamed, and times its parsing helpers, user resolution and handle_request()
+ * in a loop, counting allocations by wrapping malloc and friends
+ *
+ * pronound is free software distributed under the terms of the GNU General Public License v3.0
+ */
+
+#define main pronound_main
+#include "pronound.c"
+#undef main
+
+/*
+ * allocation counting
+ * glibc lets a program replace malloc; these count every call, from pronound and from libc itself, and hand over to
+ * the real allocator
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+uint64_t allocations = 0;
+
+void *malloc(size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/*
+ * benchmarks
+ * each runs its body iterations times, cycling through the fixture inputs, for a number of rounds; the rounds are kept
+ * as samples in the JSON output, for pronoun-bench compare
+ */
+#define MAX_ROUNDS 64
+
+struct Result {
+	const char *name;
+	double ns_per_op[MAX_ROUNDS];
+	double allocs_per_op[MAX_ROUNDS];
+};
+
+#define BENCHMARKS 6
+
+struct Result bench_results[BENCHMARKS];
+int bench_count = 0;
+int rounds = 5;
+
+const char **inputs;
+int input_count;
+long iterations = 200000;
+
+// keeps the compiler from dropping a result nobody reads
+volatile uintptr_t sink;
+
+FILE *results; // the real stdout; stdout itself goes to /dev/null
+
+void bench_strip(long i) {
+	char *stripped = strip(inputs[i % input_count]);
+	sink += (uintptr_t)stripped;
+	free(stripped);
+}
+
+void bench_strip_in_place(long i) {
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), " %s\r\n", inputs[i % input_count]);
+	sink += (uintptr_t)strip_in_place(buffer);
+}
+
+void bench_is_number(long i) {
+	sink += is_number(inputs[i % input_count]);
+}
+
+void bench_split_first_space(long i) {
+	char line[300];
+	snprintf(line, sizeof(line), "defaults %s", inputs[i % input_count]);
+	char *first, *rest;
+	split_first_space(line, &first, &rest);
+	sink += (uintptr_t)first ^ (uintptr_t)rest;
+	free(first);
+	free(rest);
+}
+
+void bench_resolve(long i) {
+	struct passwd pw;
+	char buf[1024];
+	sink += resolve(inputs[i % input_count], &pw, buf, sizeof(buf));
+}
+
+void bench_handle_request(long i) {
+	struct Reply reply;
+	read_begin();
+	handle_request(inputs[i % input_count], &reply);
+	sink += reply.response->len;
+	if (reply.table)
+		response_release(reply.table);
+	read_end();
+	// stand in for the refresher, so retired memory doesn't pile up over a run
+	if ((i & 1023) == 0)
+		reclaim();
+}
+
+double mean(const double *samples, int count) {
+	double sum = 0;
+	for (int i = 0; i < count; i++)
+		sum += samples[i];
+	return sum / count;
+}
+
+void run(const char *name, void (*body)(long)) {
+	for (long i = 0; i < iterations / 10; i++)
+		body(i); // warm up caches, ours (so handle_request measures hits) and the CPU's
+
+	struct Result *result = &bench_results[bench_count++];
+	result->name = name;
+	for (int round = 0; round < rounds; round++) {
+		uint64_t allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+		uint64_t started = monotonic_ns();
+		for (long i = 0; i < iterations; i++)
+			body(i);
+		uint64_t elapsed = monotonic_ns() - started;
+		allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocated;
+		result->ns_per_op[round] = (double)elapsed / iterations;
+		result->allocs_per_op[round] = (double)allocated / iterations;
+	}
+	fprintf(results, "%-24s %10.1f ns/op %8.2f allocs/op\n", name, mean(result->ns_per_op, rounds),
+	        mean(result->allocs_per_op, rounds));
+}
+
+void json_samples(FILE *out, const char *name, const char *unit, const double *samples, bool last) {
+	fprintf(out, "    \"%s.%s\": {\"value\": %.6g, \"better\": \"lower\", \"samples\": [", name, unit,
+	        mean(samples, rounds));
+	for (int i = 0; i < rounds; i++)
+		fprintf(out, "%s%.6g", i ? ", " : "", samples[i]);
+	fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+// in the shape pronoun-bench writes, so pronoun-bench compare can read it
+bool write_json(const char *path) {
+	FILE *out = strcmp(path, "-") == 0 ? results : fopen(path, "w");
+	if (!out) {
+		perror("Could not write results");
+		return false;
+	}
+	fprintf(out, "{\n  \"tool\": \"pronound-microbench\",\n  \"inputs\": %d, \"iterations\": %ld, \"rounds\": %d,\n",
+	        input_count, iterations, rounds);
+	fprintf(out, "  \"metrics\": {\n");
+	for (int i = 0; i < bench_count; i++) {
+		json_samples(out, bench_results[i].name, "ns_per_op", bench_results[i].ns_per_op, false);
+		json_samples(out, bench_results[i].name, "allocs_per_op", bench_results[i].allocs_per_op,
+		             i == bench_count - 1);
+	}
+	fprintf(out, "  }\n}\n");
+	if (out != results)
+		fclose(out);
+	return true;
+}
+
+// users to query: from a file, one per line, as written by pronoun-fixture, or the defaults below
+bool load_inputs(const char *path) {
+	static const char *defaults[] = {"root", "0", "nobody", "65534", "no-such-user", "  padded  "};
+	if (!path) {
+		inputs = defaults;
+		input_count = sizeof(defaults) / sizeof(defaults[0]);
+		return true;
+	}
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror("Could not open users file");
+		return false;
+	}
+	char line[256];
+	int size = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (input_count == size) {
+			size = size ? size * 2 : 1024;
+			const char **grown = realloc(inputs, size * sizeof(char *));
+			if (!grown) {
+				fclose(file);
+				return false;
+			}
+			inputs = grown;
+		}
+		inputs[input_count++] = strdup(line);
+	}
+	fclose(file);
+	return input_count > 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *users_path = NULL;
+	const char *json_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "C:u:n:r:j:")) != -1) {
+		switch (opt) {
+			case 'C':
+				config_path = optarg;
+				break;
+			case 'u':
+				users_path = optarg;
+				break;
+			case 'n':
+				iterations = atol(optarg);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			case 'j':
+				json_path = optarg;
+				break;
+			default:
+				fprintf(stderr,
+				        "Usage: %s [-C config_file] [-u users_file] [-n iterations] [-r rounds] [-j results.json]\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (iterations < 1 || rounds < 1 || rounds > MAX_ROUNDS) {
+		fprintf(stderr, "iterations must be positive, and rounds between 1 and %d\n", MAX_ROUNDS);
+		return 1;
+	}
+
+	// the config is optional here, the defaults (NSS, a cache) make a fine benchmark too
+	if (access(config_path, R_OK) == 0 && !parse_config(config_path)) {
+		fprintf(stderr, "Failed to parse config file\n");
+		return 1;
+	}
+	if (config.passwd_file && !fixture_load(config.passwd_file)) {
+		fprintf(stderr, "Failed to load passwd file\n");
+		return 1;
+	}
+	if (!load_inputs(users_path))
+		return 1;
+
+	// handle_request runs as the only worker, so cache hits take the lock-free path as they would in the daemon
+	if (posix_memalign((void **)&workers, 64, sizeof(struct Worker)) != 0)
+		return 1;
+	memset(workers, 0, sizeof(struct Worker));
+	workers[0].metrics = calloc(1, sizeof(struct Metrics));
+	worker_count = 1;
+	current_worker = &workers[0];
+	if (!responses_init()) {
+		fprintf(stderr, "Failed to build response table\n");
+		return 1;
+	}
+
+	// resolve() reports unknown users on stdout, keep that out of the results
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (!results || !freopen("/dev/null", "w", stdout))
+		return 1;
+
+	// with the JSON going to stdout, the table goes to stderr
+	FILE *json_out = results;
+	if (json_path && strcmp(json_path, "-") == 0)
+		results = stderr;
+	fprintf(results, "%d inputs, %ld iterations, %d rounds, users from %s\n", input_count, iterations, rounds,
+	        config.passwd_file ? config.passwd_file : "NSS");
+	run("strip", bench_strip);
+	run("strip_in_place", bench_strip_in_place);
+	run("is_number", bench_is_number);
+	run("split_first_space", bench_split_first_space);
+	run("resolve", bench_resolve);
+	run("handle_request", bench_handle_request);
+	results = json_out;
+	if (json_path && !write_json(json_path))
+		return 1;
+	fclose(results);
+	return 0;
+}
@@ -21,6 +21,23 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#ifdef PRONOUND_USDT
+#include <sys/sdt.h>
+#endif
 
 struct Config {
 	bool daemonise;         // whether to run as a daemon, or let itself be handled by a service manager
@@ -28,15 +45,55 @@ char *default_pronouns; // default pronouns to return if no pronouns are set
 	char *file_path;        // path to the pronouns file from $HOME of user
 	int port;               // port to listen on for requests, default is 731
 	char *daemon_user;      // user to run the daemon as, default is "_pronound"
+	int cache_ttl;          // seconds a looked up reply is served from the cache, 0 disables caching
+	int workers;            // number of threads accepting and answering requests
+	int refresh_ahead;      // seconds before expiry in which popular entries are refreshed, 0 disables
+	int refresh_hits;       // hits within a ttl for an entry to count as popular
+	int lookup_timeout;     // milliseconds a request waits on a lookup before serving the last known reply, 0 waits
+	int lookup_threads;     // most lookups running at once, each on a thread of the lookup pool
+	int breaker_cooldown;   // seconds a home directory mount is skipped after a lookup under it timed out
+	int cache_bytes;        // memory budget for the cache, entries and replies included
+	char *access_log;       // file to log every request to, "syslog" for syslog, NULL for no access log
+	char *metrics;          // port or unix socket path to serve Prometheus metrics on, NULL for none
+	int trace_slow;         // milliseconds after which a request is logged with its stages, 0 to disable
+	int trace_sample;       // only log one in this many slow requests
+	char *admin_socket;     // unix socket taking admin commands, NULL for none
+	char *passwd_file;      // look users up in this file instead of through NSS, NULL to use NSS
+	int keepalive;          // milliseconds to keep a connection open after a query in case more follow
+	bool udp;               // also answer queries sent as datagrams, on the same port
+	int upstream_limit;     // most connections open to each upstream or shard backend at once
+	int health_interval;    // seconds between health checks of shard backends
+	char *snapshot_serve;   // port or unix socket path to serve snapshots to replicas on, NULL for none
+	char *replicate;        // address and port of the primary to fetch snapshots from, NULL to look users up here
+	char *snapshot_file;    // where a replica keeps the snapshot it answers from
+	int snapshot_interval;  // seconds between snapshots being built, or fetched
+	int watch_interval;     // seconds between watched users being looked up again, 0 to rely on inotify alone
 };
 
 struct Config config = {.daemonise = false,
                         .default_pronouns = "not specified",
                         .file_path = ".pronouns",
                         .port = 731,
-                        .daemon_user = "_pronound"};
+                        .daemon_user = "_pronound",
+                        .cache_ttl = 60,
+                        .workers = 4,
+                        .refresh_ahead = 10,
+                        .refresh_hits = 5,
+                        .lookup_timeout = 2000,
+                        .lookup_threads = 16,
+                        .breaker_cooldown = 30,
+                        .cache_bytes = 8 << 20,
+                        .upstream_limit = 3,
+                        .health_interval = 5,
+                        .snapshot_file = "/var/cache/pronound/snapshot",
+                        .snapshot_interval = 60,
+                        .watch_interval = 30,
+                        .trace_sample = 1};
 int sockfd;
+int udp_sockfd = -1; // only open with udp set
+int parked_count = 0; // connections waiting on their client to send more
 bool daemonised = false;
+const char *config_path = "/etc/pronound.conf"; // PRONOUND_CONFIG or -C if given, reread on SIGHUP
 
 void error(const char *msg, ...) {
 	va_list args;
@@ -82,232 +139,4392 @@ char *strip(const char *str) {
 	return result;
 }
 
-uid_t resolve(const char *input, bool *failed) {
+bool split_first_space(const char *str, char **first, char **rest) {
+	const char *space = strchr(str, ' ');
+	if (!space) {
+		*first = strdup(str);
+		*rest = NULL;
+		return true;
+	}
+
+	size_t first_len = space - str;
+	*first = malloc(first_len + 1);
+	if (!*first)
+		return false;
+
+	strncpy(*first, str, first_len);
+	(*first)[first_len] = '\0';
+
+	*rest = strdup(space + 1);
+	return true;
+}
+
+/*
+ * fixture passwd file
+ * with passwd_file set, users are looked up in that file rather than through NSS, so the daemon can serve a synthetic
+ * user base (see pronoun-fixture) without root; the file is read into memory, and sorted by name and by uid, on
+ * startup and SIGHUP
+ */
+struct FixtureUser {
+	char *name;
+	char *dir;
+	uid_t uid;
+	gid_t gid;
+};
+
+struct Fixture {
+	char *text; // the file, with the fields of each user split in place
+	struct FixtureUser *by_name;
+	struct FixtureUser *by_uid;
+	size_t count;
+};
+
+struct Fixture fixture;
+pthread_rwlock_t fixture_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int fixture_compare_name(const void *a, const void *b) {
+	return strcmp(((const struct FixtureUser *)a)->name, ((const struct FixtureUser *)b)->name);
+}
+
+int fixture_compare_uid(const void *a, const void *b) {
+	uid_t x = ((const struct FixtureUser *)a)->uid, y = ((const struct FixtureUser *)b)->uid;
+	return x < y ? -1 : x > y;
+}
+
+bool fixture_load(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror("Could not open passwd file");
+		return false;
+	}
+
+	struct Fixture loaded = {0};
+	size_t size = 0, len = 0;
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		if (len + n + 1 > size) {
+			size = (len + n + 1) * 2;
+			char *text = realloc(loaded.text, size);
+			if (!text) {
+				free(loaded.text);
+				fclose(file);
+				return false;
+			}
+			loaded.text = text;
+		}
+		memcpy(loaded.text + len, chunk, n);
+		len += n;
+	}
+	fclose(file);
+	if (!loaded.text)
+		loaded.text = strdup("");
+	else
+		loaded.text[len] = '\0';
+
+	size_t lines = 1;
+	for (size_t i = 0; i < len; i++)
+		lines += loaded.text[i] == '\n';
+	loaded.by_name = malloc(lines * sizeof(struct FixtureUser));
+	loaded.by_uid = malloc(lines * sizeof(struct FixtureUser));
+	if (!loaded.text || !loaded.by_name || !loaded.by_uid) {
+		free(loaded.text);
+		free(loaded.by_name);
+		free(loaded.by_uid);
+		return false;
+	}
+
+	// name:password:uid:gid:gecos:dir:shell, lines that don't have all seven are skipped
+	char *rest = loaded.text;
+	char *line;
+	while ((line = strsep(&rest, "\n"))) {
+		char *fields[7];
+		int count = 0;
+		while (count < 7 && (fields[count] = strsep(&line, ":")))
+			count++;
+		if (count < 7 || !fields[0][0] || !is_number(fields[2]) || !is_number(fields[3]))
+			continue;
+		struct FixtureUser *user = &loaded.by_name[loaded.count++];
+		user->name = fields[0];
+		user->uid = (uid_t)strtoul(fields[2], NULL, 10);
+		user->gid = (gid_t)strtoul(fields[3], NULL, 10);
+		user->dir = fields[5];
+	}
+	qsort(loaded.by_name, loaded.count, sizeof(struct FixtureUser), fixture_compare_name);
+	memcpy(loaded.by_uid, loaded.by_name, loaded.count * sizeof(struct FixtureUser));
+	qsort(loaded.by_uid, loaded.count, sizeof(struct FixtureUser), fixture_compare_uid);
+
+	pthread_rwlock_wrlock(&fixture_lock);
+	struct Fixture old = fixture;
+	fixture = loaded;
+	pthread_rwlock_unlock(&fixture_lock);
+	free(old.text);
+	free(old.by_name);
+	free(old.by_uid);
+	return true;
+}
+
+// the fixture's answer to getpwnam_r/getpwuid_r, with the strings copied into buf
+bool fixture_resolve(const char *input, struct passwd *pw, char *buf, size_t buflen) {
+	struct FixtureUser key = {.name = (char *)input};
+	bool by_uid = is_number(input);
+	if (by_uid)
+		key.uid = (uid_t)atoi(input);
+
+	bool found = false;
+	pthread_rwlock_rdlock(&fixture_lock);
+	const struct FixtureUser *user =
+	    by_uid ? bsearch(&key, fixture.by_uid, fixture.count, sizeof(struct FixtureUser), fixture_compare_uid)
+	           : bsearch(&key, fixture.by_name, fixture.count, sizeof(struct FixtureUser), fixture_compare_name);
+	if (user) {
+		size_t name_len = strlen(user->name) + 1, dir_len = strlen(user->dir) + 1;
+		if (name_len + dir_len + 1 <= buflen) {
+			memset(pw, 0, sizeof(*pw));
+			pw->pw_name = memcpy(buf, user->name, name_len);
+			pw->pw_dir = memcpy(buf + name_len, user->dir, dir_len);
+			pw->pw_passwd = pw->pw_gecos = pw->pw_shell = buf + name_len + dir_len;
+			*pw->pw_shell = '\0';
+			pw->pw_uid = user->uid;
+			pw->pw_gid = user->gid;
+			found = true;
+		}
+	}
+	pthread_rwlock_unlock(&fixture_lock);
+	return found;
+}
+
+// look up a user by name or uid into pw, using the reentrant NSS calls as several workers resolve at once
+bool resolve(const char *input, struct passwd *pw, char *buf, size_t buflen) {
+	if (config.passwd_file)
+		return fixture_resolve(input, pw, buf, buflen);
+
+	struct passwd *result = NULL;
 	if (is_number(input)) {
 		uid_t uid = (uid_t)atoi(input);
-		struct passwd *pw = getpwuid(uid);
-		if (pw) {
-			return pw->pw_uid;
+		getpwuid_r(uid, pw, buf, buflen, &result);
+	} else {
+		getpwnam_r(input, pw, buf, buflen, &result);
+		if (!result)
+			printf("User %s not found\n", input);
+	}
+	return result != NULL;
+}
+
+// strip without copying, for buffers we own; returns a pointer into str
+char *strip_in_place(char *str) {
+	while (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r')
+		str++;
+	size_t len = strlen(str);
+	while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\n' || str[len - 1] == '\r'))
+		len--;
+	str[len] = '\0';
+	return str;
+}
+
+/*
+ * deferred reclamation
+ * cache hits are served without taking any lock, so memory a worker might be reading (an old response table, an
+ * array replaced by a resize or a compaction) is retired rather than freed, and only freed once every worker has
+ * started a new request since (quiescent-state based reclamation)
+ */
+struct Worker {
+	uint64_t epoch;  // global epoch when the current request started, 0 while idle or on the locked path
+	uint64_t hits;   // counters owned by the worker, summed when read, so hits don't share a cache line
+	uint64_t misses;
+	struct AccessRing *log;
+	struct Metrics *metrics;
+} __attribute__((aligned(64)));
+
+struct Retired {
+	struct Retired *next;
+	void *ptr;
+	uint64_t epoch; // freed once no worker is in a request that started before this
+};
+
+struct Worker *workers = NULL;
+int worker_count = 0;
+__thread struct Worker *current_worker = NULL;
+
+uint64_t global_epoch = 1;
+struct Retired *retired = NULL;
+pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// called once whatever pointed at ptr has been replaced
+void retire(void *ptr) {
+	struct Retired *entry = malloc(sizeof(struct Retired));
+	if (!entry)
+		return; // leaking is the only safe option left
+	entry->ptr = ptr;
+	entry->epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&retire_lock);
+	entry->next = retired;
+	retired = entry;
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void reclaim() {
+	uint64_t oldest = UINT64_MAX;
+	for (int i = 0; i < worker_count; i++) {
+		uint64_t epoch = __atomic_load_n(&workers[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	pthread_mutex_lock(&retire_lock);
+	for (struct Retired **link = &retired; *link;) {
+		struct Retired *entry = *link;
+		if (entry->epoch <= oldest) {
+			*link = entry->next;
+			free(entry->ptr);
+			free(entry);
 		} else {
-			*failed = true;
-			return 0; // we can't count on uid_t being signed
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void read_begin() {
+	if (current_worker) {
+		__atomic_store_n(&current_worker->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void read_end() {
+	if (current_worker)
+		__atomic_store_n(&current_worker->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * response table
+ * every reply we can send lives in one contiguous table, stored as a length prefix followed by the bytes to put on
+ * the wire (newline included), so answering a request is a single send() of memory that already exists
+ *
+ * a table never moves or shrinks once allocated; compacting or flushing the cache swaps in a fresh table, and the old
+ * one is retired when the last reference to it is dropped (cache hits don't take one, they are covered by read_begin)
+ */
+struct Response {
+	uint32_t len;
+	char data[];
+};
+
+struct ResponseTable {
+	int refs; // one for being the current table, plus one per reply being sent from it
+	size_t used;
+	size_t size;
+	char base[];
+};
+
+#define RESPONSE_TABLE_MIN (4 << 10)
+
+struct ResponseTable *responses;
+uint32_t response_not_found; // offset of the precomputed "user not found" reply
+uint32_t response_default;   // offset of the precomputed config.default_pronouns reply
+size_t responses_fixed;      // end of the precomputed replies, everything after belongs to the cache
+
+/*
+ * cache_lock serialises writers to the cache, the flights and appends to the current response table; readers of
+ * the cache go through cache_read() instead
+ */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const struct Response *response_at(const struct ResponseTable *table, uint32_t offset) {
+	return (const struct Response *)(table->base + offset);
+}
+
+void response_release(struct ResponseTable *table) {
+	if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		retire(table);
+}
+
+// bytes a reply takes in the table, padded to keep the length prefixes aligned
+size_t response_entry_size(uint32_t wire_len) {
+	return (sizeof(struct Response) + wire_len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+}
+
+// append a reply to the current table, adding the newline if it is missing; returns its offset or UINT32_MAX if full
+uint32_t response_add(const char *value, size_t len) {
+	bool newline = len > 0 && value[len - 1] == '\n';
+	size_t wire_len = len + (newline ? 0 : 1);
+	size_t entry = response_entry_size((uint32_t)wire_len);
+
+	if (responses->used + entry > responses->size)
+		return UINT32_MAX;
+
+	uint32_t offset = (uint32_t)responses->used;
+	struct Response *response = (struct Response *)(responses->base + offset);
+	response->len = (uint32_t)wire_len;
+	memcpy(response->data, value, len);
+	if (!newline)
+		response->data[len] = '\n';
+	responses->used += entry;
+	return offset;
+}
+
+/*
+ * cache of replies, keyed by the query as received (a username or uid)
+ *
+ * entries are small fixed-size records: the query lives in a pool of names, and the reply is an interned value, so
+ * the many users sharing "she/her" or "they/them" share one copy of it in the response table
+ *
+ * memory is bounded by cache_bytes: the entries, their index, the name pool, the values and the response table are
+ * allocated up front from that budget, and when any of them runs out entries are evicted with S3-FIFO, so a sweep over
+ * every account (which touches each key once) passes through the small queue without flushing the popular entries
+ * out of the main one
+ */
+struct CacheEntry {
+	uint32_t name;  // offset of the query in the name pool
+	uint32_t value; // interned reply
+	uint32_t stamp; // monotonic second the entry expires at
+	uint32_t hash;
+	uint32_t next;  // next entry in the same queue
+	// hits and freq are bumped by lock-free readers, so are only ever accessed atomically
+	uint16_t hits;  // hits since the entry was last stored, to pick what to refresh ahead of expiry
+	uint8_t freq;   // S3-FIFO access counter, saturating at 3
+	uint8_t queue;
+};
+
+enum {
+	QUEUE_FREE,
+	QUEUE_SMALL, // newly inserted entries, a tenth of the capacity
+	QUEUE_MAIN,  // entries hit again while in the small queue, or recently evicted from it
+};
+
+#define NO_ENTRY UINT32_MAX
+
+struct Queue {
+	uint32_t head; // oldest entry, popped first
+	uint32_t tail;
+	uint32_t count;
+};
+
+/*
+ * interned replies; ids are stable while referenced, and unreferenced ones are reclaimed when the response table
+ * is compacted
+ */
+struct Value {
+	uint32_t response; // offset of the reply in the response table, or the next free id
+	uint32_t hash;
+	uint32_t refs; // cache entries using it
+};
+
+enum {
+	VALUE_NOT_FOUND, // the precomputed replies, never reclaimed
+	VALUE_DEFAULT,
+	VALUES_FIXED,
+};
+
+#define NO_VALUE UINT32_MAX
+
+struct Cache {
+	struct CacheEntry *entries;
+	uint32_t capacity;
+	uint32_t *index; // open addressing over entry number + 1, 0 if empty
+	uint32_t index_mask;
+	uint32_t *ghost; // hashes of keys recently evicted from the small queue, one per bucket
+	uint32_t ghost_mask;
+	struct Queue free;
+	struct Queue small;
+	struct Queue main;
+
+	char *names;
+	uint32_t names_used;
+	uint32_t names_size;
+	uint32_t names_live; // bytes of the pool used by live entries
+
+	struct Value *values;
+	uint32_t values_capacity;
+	uint32_t values_used;     // ids handed out so far, reclaimed ones are on the free list
+	uint32_t values_free;     // first reclaimed id, or NO_VALUE
+	uint32_t *values_index;   // open addressing over value id + 1, 0 if empty
+	uint32_t values_mask;
+	size_t value_bytes;       // bytes of the response table used by referenced values
+
+	size_t budget;
+	uint64_t hits; // from lookups outside a worker, the workers count their own
+	uint64_t misses;
+	uint64_t evictions;
+
+	uint32_t seq __attribute__((aligned(64))); // odd while a writer is changing entries, values or the index
+};
+
+/*
+ * what cache_read() needs, published as one pointer so a reader always sees arrays and their sizes that belong
+ * together; replaced whenever any of them is, with the old one retired
+ */
+struct CacheView {
+	const struct CacheEntry *entries;
+	uint32_t capacity;
+	const uint32_t *index;
+	uint32_t index_mask;
+	const char *names; // NUL-terminated at names[names_size], so a torn name can't be read past the end
+	uint32_t names_size;
+	const struct Value *values;
+	uint32_t values_capacity;
+	const struct ResponseTable *table;
+};
+
+#define NAME_COST 12   // bytes of name pool budgeted per entry
+#define VALUE_RATIO 16 // entries per interned value budgeted for
+#define CACHE_ENTRY_COST (sizeof(struct CacheEntry) + 3 * sizeof(uint32_t) + NAME_COST)
+
+struct Cache cache;
+struct CacheView *cache_view = NULL;
+
+enum ResultClass {
+	RESULT_FOUND,     // the user's pronouns
+	RESULT_DEFAULT,   // the user has none set
+	RESULT_NOT_FOUND, // no such user
+	RESULT_STALE,     // an earlier reply, as the lookup didn't finish in time
+	RESULT_CLASSES,
+};
+
+const char *result_names[RESULT_CLASSES] = {"found", "default", "not_found", "stale"};
+
+// a reply to send, and what keeps it alive: a reference on table, or the worker's read section if table is NULL
+struct Reply {
+	const struct Response *response;
+	struct ResponseTable *table;
+	enum ResultClass result;
+};
+
+/*
+ * latency histograms, HDR style: exact below 4us, then HIST_SUB buckets per power of two, so the relative error
+ * stays within 1/HIST_SUB at any scale; values are in microseconds, anything past the last bucket lands in it
+ */
+enum Stage {
+	STAGE_READ,      // accept to the query being read
+	STAGE_RESOLVE,   // the passwd lookup
+	STAGE_OPEN,      // opening the pronouns file
+	STAGE_FILE_READ, // reading it
+	STAGE_LOOKUP,    // a cache miss, from the cache check to a reply being ready
+	STAGE_WRITE,     // sending the reply
+	STAGE_TOTAL,     // accept to the reply being sent
+	STAGES,
+};
+
+const char *stage_names[STAGES] = {"read", "resolve", "open", "file_read", "lookup", "write", "total"};
+
+#define HIST_SUB 2
+#define HIST_BUCKETS 52 // up to 2^26us, about a minute
+
+struct Metrics {
+	uint64_t results[RESULT_CLASSES];
+	uint64_t latency[STAGES][HIST_BUCKETS];
+	uint64_t latency_sum[STAGES];
+	uint64_t slow; // requests slower than trace_slow
+	int active; // connections the worker is answering, 0 or 1
+};
+
+int histogram_bucket(uint64_t us) {
+	if (us < 4)
+		return (int)us;
+	int exponent = 63 - __builtin_clzll(us);
+	int sub = (int)((us >> (exponent - 1)) & (HIST_SUB - 1));
+	int bucket = 4 + (exponent - 2) * HIST_SUB + sub;
+	return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// the largest value, in microseconds, that lands in a bucket
+uint64_t histogram_upper(int bucket) {
+	if (bucket < 4)
+		return bucket;
+	int exponent = (bucket - 4) / HIST_SUB + 2;
+	int sub = (bucket - 4) % HIST_SUB;
+	return ((uint64_t)(HIST_SUB + sub + 1) << (exponent - 1)) - 1;
+}
+
+// only the owning worker writes its counters, so a relaxed store is enough for the scraper to read them whole
+void counter_add(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * per-request traces
+ * each thread answering or looking up a query notes how long each stage took in its current_trace; a lookup thread
+ * traces into its flight, and requests sharing the flight copy its stages, so a slow reply shows where the time went
+ * with -DPRONOUND_USDT, each stage also fires a pronound:stage probe (name, microseconds) for bpftrace and the like
+ */
+#ifdef PRONOUND_USDT
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(pronound, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(pronound, name, a, b, c)
+#else
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_PROBE3(name, a, b, c)
+#endif
+
+struct Trace {
+	uint32_t us[STAGES];
+	uint32_t seen; // bit per stage recorded
+};
+
+__thread struct Trace *current_trace = NULL;
+
+void trace_stage(enum Stage stage, uint64_t started_ns, uint64_t ended_ns) {
+	uint64_t us = (ended_ns - started_ns) / 1000;
+	TRACE_PROBE2(stage, stage_names[stage], us);
+	if (!current_trace)
+		return;
+	current_trace->us[stage] = us < UINT32_MAX ? (uint32_t)us : UINT32_MAX;
+	current_trace->seen |= 1u << stage;
+}
+
+// copy the stages of a lookup done elsewhere into the current trace
+void trace_merge(const struct Trace *trace) {
+	if (!current_trace)
+		return;
+	for (int s = 0; s < STAGES; s++) {
+		if (trace->seen & (1u << s))
+			current_trace->us[s] = trace->us[s];
+	}
+	current_trace->seen |= trace->seen;
+}
+
+// add a finished request's stages to the worker's histograms
+void trace_record(const struct Trace *trace) {
+	struct Metrics *metrics = current_worker->metrics;
+	for (int s = 0; s < STAGES; s++) {
+		if (trace->seen & (1u << s)) {
+			counter_add(&metrics->latency[s][histogram_bucket(trace->us[s])], 1);
+			counter_add(&metrics->latency_sum[s], trace->us[s]);
 		}
+	}
+}
+
+// log a request slower than trace_slow, along with where its time went
+void trace_log(const char *query, enum ResultClass result, const struct Trace *trace) {
+	char line[512];
+	size_t len = snprintf(line, sizeof(line), "slow request for \"%.64s\" (%s):", query, result_names[result]);
+	for (int s = 0; s < STAGES && len < sizeof(line); s++) {
+		if (trace->seen & (1u << s))
+			len += snprintf(line + len, sizeof(line) - len, " %s %.3fms", stage_names[s], trace->us[s] / 1e3);
+	}
+
+	if (daemonised) {
+		syslog(LOG_INFO, "%s", line);
 	} else {
-		struct passwd *pw = getpwnam(input);
-		if (pw) {
-			return pw->pw_uid;
-		} else {
-			printf("User %s not found\n", input);
-			*failed = true;
-			return 0; // we can't count on uid_t being signed
+		fprintf(stderr, "%s\n", line);
+	}
+}
+
+/*
+ * lookups in progress
+ * the first request to miss on a key starts the lookup, and any request for the same key arriving in the meantime
+ * waits for it and shares the result, so a burst of queries for one user costs a single lookup
+ *
+ * the lookup itself runs on a thread of the lookup pool, so requests only wait for it up to lookup_timeout and then
+ * serve the last known reply; a lookup stuck on a dead mount finishes (and fills the cache) whenever the mount comes
+ * back, and holds on to its thread until then, so the pool has at most lookup_threads threads and a bounded queue, and
+ * a request finding the queue full is answered from the cache at once
+ */
+struct Flight {
+	struct Flight *next;
+	char *key;
+	uint32_t hash;
+	bool done;      // the result is set and the flight is no longer in flights
+	bool timed_out; // a request gave up on it, later requests for the key don't wait
+	bool skipped;   // the mount was being skipped, so the result is what the cache had
+	int waiters;    // requests waiting on it; freed by whoever sees done with no waiters left
+	char mount[128]; // directory holding the user's home, once known, for the breaker
+	struct ResponseTable *table; // result, with a reference held by the flight
+	uint32_t response;
+	enum ResultClass result;
+	struct Trace trace; // stages of the lookup, written by the lookup before done is set
+	uint64_t started;   // monotonic_ns() when the lookup began
+	pthread_cond_t cond;
+};
+
+struct Flight *flights = NULL;
+
+uint32_t hash_string(const char *str) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t hash_bytes(const char *str, size_t len) {
+	uint32_t hash = 2166136261u;
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+time_t monotonic_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * the slowest lookups of the last SLOW_LOOKUP_WINDOW seconds, for the statistics; cache_lock must be held
+ * a new lookup replaces one that has aged out, or else the fastest one, if it was slower than that
+ */
+struct SlowLookup {
+	char key[32];
+	uint32_t us;
+	time_t at;
+};
+
+#define SLOW_LOOKUPS 8
+#define SLOW_LOOKUP_WINDOW 300
+
+struct SlowLookup slow_lookups[SLOW_LOOKUPS];
+uint64_t cache_generation = 0; // bumped each time the cache is rebuilt, on startup and SIGHUP
+time_t started_at;
+
+void slow_lookup_note(const char *key, uint32_t us) {
+	time_t now = monotonic_seconds();
+	struct SlowLookup *slot = &slow_lookups[0];
+	for (int i = 0; i < SLOW_LOOKUPS; i++) {
+		if (now - slow_lookups[i].at > SLOW_LOOKUP_WINDOW) {
+			slot = &slow_lookups[i];
+			break;
+		}
+		if (slow_lookups[i].us < slot->us)
+			slot = &slow_lookups[i];
+	}
+	if (now - slot->at <= SLOW_LOOKUP_WINDOW && slot->us >= us)
+		return;
+	snprintf(slot->key, sizeof(slot->key), "%s", key);
+	slot->us = us;
+	slot->at = now;
+}
+
+int slow_lookup_compare(const void *a, const void *b) {
+	const struct SlowLookup *x = a, *y = b;
+	return x->us < y->us ? 1 : x->us > y->us ? -1 : 0;
+}
+
+// replace the view readers use with one matching the cache; cache_lock must be held
+void cache_publish() {
+	struct CacheView *view = malloc(sizeof(struct CacheView));
+	if (view) {
+		view->entries = cache.entries;
+		view->capacity = cache.capacity;
+		view->index = cache.index;
+		view->index_mask = cache.index_mask;
+		view->names = cache.names;
+		view->names_size = cache.names_size;
+		view->values = cache.values;
+		view->values_capacity = cache.values_capacity;
+		view->table = responses;
+	}
+	// without a view, readers fall back to the locked path until the next publish
+	struct CacheView *old = __atomic_exchange_n(&cache_view, view, __ATOMIC_ACQ_REL);
+	if (old)
+		retire(old);
+}
+
+// bracket every change to entries, values or the index; cache_lock must be held
+void cache_write_begin() {
+	__atomic_store_n(&cache.seq, cache.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void cache_write_end() {
+	__atomic_store_n(&cache.seq, cache.seq + 1, __ATOMIC_RELEASE);
+}
+
+void queue_push(struct Queue *queue, uint32_t e) {
+	cache.entries[e].next = NO_ENTRY;
+	if (queue->count++ == 0)
+		queue->head = e;
+	else
+		cache.entries[queue->tail].next = e;
+	queue->tail = e;
+}
+
+uint32_t queue_pop(struct Queue *queue) {
+	if (queue->count == 0)
+		return NO_ENTRY;
+	uint32_t e = queue->head;
+	queue->head = cache.entries[e].next;
+	queue->count--;
+	return e;
+}
+
+const char *entry_name(const struct CacheEntry *entry) {
+	return cache.names + entry->name;
+}
+
+uint32_t entry_response(const struct CacheEntry *entry) {
+	return cache.values[entry->value].response;
+}
+
+// find or add the interned copy of a reply; returns its id, or NO_VALUE if the values or the table are full
+uint32_t value_intern(const char *value, size_t len) {
+	uint32_t hash = hash_bytes(value, len);
+	uint32_t i;
+	for (i = hash & cache.values_mask; cache.values_index[i]; i = (i + 1) & cache.values_mask) {
+		uint32_t id = cache.values_index[i] - 1;
+		const struct Response *response = response_at(responses, cache.values[id].response);
+		if (cache.values[id].hash == hash && response->len == len + 1 && memcmp(response->data, value, len) == 0)
+			return id;
+	}
+
+	uint32_t id = cache.values_free;
+	if (id == NO_VALUE && cache.values_used == cache.values_capacity)
+		return NO_VALUE;
+	uint32_t response = response_add(value, len);
+	if (response == UINT32_MAX)
+		return NO_VALUE;
+	if (id != NO_VALUE)
+		cache.values_free = cache.values[id].response;
+	else
+		id = cache.values_used++;
+
+	cache.values[id].response = response;
+	cache.values[id].hash = hash;
+	cache.values[id].refs = 0;
+	cache.values_index[i] = id + 1;
+	return id;
+}
+
+void value_ref(uint32_t id) {
+	if (id >= VALUES_FIXED && cache.values[id].refs++ == 0)
+		cache.value_bytes += response_entry_size(response_at(responses, cache.values[id].response)->len);
+}
+
+void value_unref(uint32_t id) {
+	if (id >= VALUES_FIXED && --cache.values[id].refs == 0)
+		cache.value_bytes -= response_entry_size(response_at(responses, cache.values[id].response)->len);
+}
+
+/*
+ * start a new response table holding the precomputed replies and the referenced values, and reclaim the ids of the
+ * rest; cache_lock must be held
+ */
+bool values_compact() {
+	struct ResponseTable *table = malloc(sizeof(struct ResponseTable) + responses->size);
+	if (!table)
+		return false;
+	table->refs = 1;
+	table->size = responses->size;
+	table->used = responses_fixed;
+	memcpy(table->base, responses->base, responses_fixed);
+
+	memset(cache.values_index, 0, (cache.values_mask + 1) * sizeof(uint32_t));
+	cache.values_free = NO_VALUE;
+	for (uint32_t id = cache.values_used; id-- > VALUES_FIXED;) {
+		struct Value *value = &cache.values[id];
+		if (value->refs == 0) {
+			value->response = cache.values_free;
+			cache.values_free = id;
+			continue;
+		}
+		const struct Response *response = response_at(responses, value->response);
+		size_t size = response_entry_size(response->len);
+		memcpy(table->base + table->used, response, size);
+		value->response = (uint32_t)table->used;
+		table->used += size;
+
+		uint32_t i = value->hash & cache.values_mask;
+		while (cache.values_index[i])
+			i = (i + 1) & cache.values_mask;
+		cache.values_index[i] = id + 1;
+	}
+
+	struct ResponseTable *old = responses;
+	responses = table;
+	cache_publish();
+	response_release(old);
+	return true;
+}
+
+// returns the position in the index holding key, or the empty position where it would go
+uint32_t cache_position(const char *key, uint32_t hash) {
+	for (uint32_t i = hash & cache.index_mask;; i = (i + 1) & cache.index_mask) {
+		uint32_t e = cache.index[i];
+		if (!e || (cache.entries[e - 1].hash == hash && strcmp(entry_name(&cache.entries[e - 1]), key) == 0))
+			return i;
+	}
+}
+
+struct CacheEntry *cache_find(const char *key, uint32_t hash) {
+	uint32_t e = cache.index[cache_position(key, hash)];
+	return e ? &cache.entries[e - 1] : NULL;
+}
+
+void cache_remove(uint32_t e) {
+	struct CacheEntry *entry = &cache.entries[e];
+	uint32_t hole = cache_position(entry_name(entry), entry->hash);
+
+	// backward shift deletion, so lookups never need tombstones
+	for (uint32_t i = (hole + 1) & cache.index_mask; cache.index[i]; i = (i + 1) & cache.index_mask) {
+		uint32_t home = cache.entries[cache.index[i] - 1].hash & cache.index_mask;
+		if (((i - home) & cache.index_mask) >= ((i - hole) & cache.index_mask)) {
+			cache.index[hole] = cache.index[i];
+			hole = i;
+		}
+	}
+	cache.index[hole] = 0;
+
+	cache.names_live -= strlen(entry_name(entry)) + 1;
+	value_unref(entry->value);
+	entry->queue = QUEUE_FREE;
+	queue_push(&cache.free, e);
+	cache.evictions++;
+}
+
+// evict one entry with S3-FIFO; returns false if the cache is empty
+bool cache_evict() {
+	while (cache.small.count + cache.main.count > 0) {
+		if (cache.small.count > cache.capacity / 10 || cache.main.count == 0) {
+			uint32_t e = queue_pop(&cache.small);
+			struct CacheEntry *entry = &cache.entries[e];
+			if (__atomic_load_n(&entry->freq, __ATOMIC_RELAXED) > 0) {
+				// hit since it came in, so it's worth keeping
+				__atomic_store_n(&entry->freq, 0, __ATOMIC_RELAXED);
+				entry->queue = QUEUE_MAIN;
+				queue_push(&cache.main, e);
+				continue;
+			}
+			cache.ghost[entry->hash & cache.ghost_mask] = entry->hash;
+			cache_remove(e);
+			return true;
+		}
+
+		uint32_t e = queue_pop(&cache.main);
+		struct CacheEntry *entry = &cache.entries[e];
+		if (__atomic_load_n(&entry->freq, __ATOMIC_RELAXED) > 0) {
+			__atomic_sub_fetch(&entry->freq, 1, __ATOMIC_RELAXED); // readers only ever add, so this can't wrap
+			queue_push(&cache.main, e);
+			continue;
+		}
+		cache_remove(e);
+		return true;
+	}
+	return false;
+}
+
+// copy the names of live entries to the start of the pool
+void names_compact() {
+	char *names = malloc(cache.names_size + 1);
+	if (!names)
+		return;
+	uint32_t used = 0;
+	for (uint32_t e = 0; e < cache.capacity; e++) {
+		struct CacheEntry *entry = &cache.entries[e];
+		if (entry->queue == QUEUE_FREE)
+			continue;
+		size_t len = strlen(entry_name(entry)) + 1;
+		memcpy(names + used, entry_name(entry), len);
+		entry->name = used;
+		used += len;
+	}
+	names[cache.names_size] = '\0';
+	char *old = cache.names;
+	cache.names = names;
+	cache.names_used = used;
+	cache_publish(); // before retiring, so no reader can pick up the old pool afterwards
+	retire(old);
+}
+
+// copy a name into the pool, evicting if it's full; returns its offset or UINT32_MAX
+uint32_t names_add(const char *name) {
+	uint32_t len = strlen(name) + 1;
+	if (len > cache.names_size / 2)
+		return UINT32_MAX;
+	if (cache.names_used + len > cache.names_size) {
+		// evict down to half the pool, so compacting isn't needed again on the next insert
+		while (cache.names_live + len > cache.names_size / 2 && cache_evict())
+			;
+		names_compact();
+		if (cache.names_used + len > cache.names_size)
+			return UINT32_MAX;
+	}
+	uint32_t offset = cache.names_used;
+	memcpy(cache.names + offset, name, len);
+	cache.names_used += len;
+	cache.names_live += len;
+	return offset;
+}
+
+/*
+ * size everything from cache_bytes and drop every cached reply, keeping only the precomputed replies in a new
+ * response table; cache_lock must be held
+ */
+bool cache_init() {
+	size_t budget = config.cache_bytes > 0 ? (size_t)config.cache_bytes : 0;
+	uint32_t capacity = budget / CACHE_ENTRY_COST;
+	if (capacity < 64)
+		capacity = 64;
+	uint32_t slots = 1;
+	while (slots < capacity * 2)
+		slots <<= 1;
+	uint32_t values_capacity = capacity / VALUE_RATIO + VALUES_FIXED;
+	uint32_t value_slots = 1;
+	while (value_slots < values_capacity * 2)
+		value_slots <<= 1;
+	size_t overhead = (size_t)capacity * CACHE_ENTRY_COST + values_capacity * sizeof(struct Value) +
+	                  value_slots * sizeof(uint32_t);
+	size_t table_size = budget > overhead + RESPONSE_TABLE_MIN ? budget - overhead : RESPONSE_TABLE_MIN;
+
+	struct CacheEntry *entries = calloc(capacity, sizeof(struct CacheEntry));
+	uint32_t *index = calloc(slots, sizeof(uint32_t));
+	uint32_t *ghost = calloc(slots / 2, sizeof(uint32_t));
+	char *names = malloc((size_t)capacity * NAME_COST + 1);
+	struct Value *values = calloc(values_capacity, sizeof(struct Value));
+	uint32_t *values_index = calloc(value_slots, sizeof(uint32_t));
+	struct ResponseTable *table = malloc(sizeof(struct ResponseTable) + table_size);
+	if (!entries || !index || !ghost || !names || !values || !values_index || !table) {
+		free(entries);
+		free(index);
+		free(ghost);
+		free(names);
+		free(values);
+		free(values_index);
+		free(table);
+		return false;
+	}
+	table->refs = 1;
+	table->size = table_size;
+	table->used = responses_fixed;
+	if (responses)
+		memcpy(table->base, responses->base, responses_fixed);
+	struct ResponseTable *old_table = responses;
+	responses = table;
+
+	// readers may be checking seq right now, so everything before it is cleared and it is left alone
+	struct Cache old = cache;
+	memset(&cache, 0, offsetof(struct Cache, seq));
+	cache.entries = entries;
+	cache.capacity = capacity;
+	cache.index = index;
+	cache.index_mask = slots - 1;
+	cache.ghost = ghost;
+	cache.ghost_mask = slots / 2 - 1;
+	cache.names = names;
+	cache.names_size = capacity * NAME_COST;
+	names[cache.names_size] = '\0';
+	cache.values = values;
+	cache.values_capacity = values_capacity;
+	cache.values_used = VALUES_FIXED;
+	cache.values_free = NO_VALUE;
+	cache.values_index = values_index;
+	cache.values_mask = value_slots - 1;
+	cache.budget = budget;
+	cache.hits = old.hits;
+	cache.misses = old.misses;
+	cache.evictions = old.evictions;
+	for (uint32_t e = 0; e < capacity; e++)
+		queue_push(&cache.free, e);
+	cache_publish();
+
+	if (old_table)
+		response_release(old_table);
+	if (old.entries) {
+		retire(old.entries);
+		retire(old.index);
+		retire(old.ghost);
+		retire(old.names);
+		retire(old.values);
+		retire(old.values_index);
+	}
+	return true;
+}
+
+// cache a reply for key; cache_lock must be held, inside cache_write_begin()
+void cache_store(const char *key, uint32_t hash, uint32_t value) {
+	struct CacheEntry *entry = cache_find(key, hash);
+	if (entry) {
+		value_unref(entry->value);
+	} else {
+		if (cache.free.count == 0 && !cache_evict())
+			return;
+		uint32_t name = names_add(key);
+		if (name == UINT32_MAX)
+			return;
+		uint32_t e = queue_pop(&cache.free);
+		entry = &cache.entries[e];
+		entry->name = name;
+		entry->hash = hash;
+		__atomic_store_n(&entry->freq, 0, __ATOMIC_RELAXED);
+		cache.index[cache_position(key, hash)] = e + 1;
+
+		uint32_t *ghost = &cache.ghost[hash & cache.ghost_mask];
+		if (*ghost == hash) {
+			// evicted from the small queue not long ago and asked for again, so it goes straight to main
+			*ghost = 0;
+			entry->queue = QUEUE_MAIN;
+			queue_push(&cache.main, e);
+		} else {
+			entry->queue = QUEUE_SMALL;
+			queue_push(&cache.small, e);
+		}
+	}
+	entry->value = value;
+	value_ref(value);
+	__atomic_store_n(&entry->hits, 0, __ATOMIC_RELAXED);
+	entry->stamp = (uint32_t)(monotonic_seconds() + config.cache_ttl);
+}
+
+/*
+ * runtime statistics, logged on SIGUSR1 and given out on the admin socket
+ * gathered from the per-worker counters and a brief hold of cache_lock, which cache hits never take, so a snapshot
+ * doesn't hold up requests
+ */
+void stats_print(FILE *out) {
+	pthread_mutex_lock(&cache_lock);
+	uint32_t entries = cache.small.count + cache.main.count;
+	size_t bytes = (size_t)entries * sizeof(struct CacheEntry) + cache.names_live + cache.value_bytes;
+	uint64_t hits = cache.hits, misses = cache.misses, evictions = cache.evictions;
+	size_t budget = cache.budget;
+	uint32_t values = cache.values_used - VALUES_FIXED;
+	int in_flight = 0;
+	for (struct Flight *flight = flights; flight; flight = flight->next)
+		in_flight++;
+	struct SlowLookup slowest[SLOW_LOOKUPS];
+	memcpy(slowest, slow_lookups, sizeof(slowest));
+	uint64_t generation = cache_generation;
+	pthread_mutex_unlock(&cache_lock);
+
+	uint64_t results[RESULT_CLASSES] = {0};
+	uint64_t requests = 0;
+	int active = 0;
+	for (int i = 0; i < worker_count; i++) {
+		hits += __atomic_load_n(&workers[i].hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&workers[i].misses, __ATOMIC_RELAXED);
+		for (int r = 0; r < RESULT_CLASSES; r++)
+			results[r] += __atomic_load_n(&workers[i].metrics->results[r], __ATOMIC_RELAXED);
+		active += __atomic_load_n(&workers[i].metrics->active, __ATOMIC_RELAXED);
+	}
+	for (int r = 0; r < RESULT_CLASSES; r++)
+		requests += results[r];
+
+	time_t uptime = monotonic_seconds() - started_at;
+	fprintf(out, "uptime: %lldd %02lld:%02lld:%02lld\n", (long long)uptime / 86400, (long long)uptime / 3600 % 24,
+	        (long long)uptime / 60 % 60, (long long)uptime % 60);
+	fprintf(out, "requests: %llu (", (unsigned long long)requests);
+	for (int r = 0; r < RESULT_CLASSES; r++)
+		fprintf(out, "%s%llu %s", r ? ", " : "", (unsigned long long)results[r], result_names[r]);
+	fprintf(out, "), %d active connections, %d lookups in flight\n", active, in_flight);
+
+	double ratio = hits + misses ? 100.0 * hits / (hits + misses) : 0;
+	fprintf(out,
+	        "cache: %u entries, %u distinct values, %zu of %zu bytes, %llu hits, %llu misses (%.1f%% hit ratio), "
+	        "%llu evictions, generation %llu\n",
+	        entries, values, bytes, budget, (unsigned long long)hits, (unsigned long long)misses, ratio,
+	        (unsigned long long)evictions, (unsigned long long)generation);
+
+	// slowest first
+	qsort(slowest, SLOW_LOOKUPS, sizeof(struct SlowLookup), slow_lookup_compare);
+	time_t now = monotonic_seconds();
+	for (int i = 0; i < SLOW_LOOKUPS && slowest[i].us; i++) {
+		if (now - slowest[i].at > SLOW_LOOKUP_WINDOW)
+			continue;
+		fprintf(out, "slow lookup: \"%s\" took %.3fms, %llds ago\n", slowest[i].key, slowest[i].us / 1e3,
+		        (long long)(now - slowest[i].at));
+	}
+}
+
+// log the statistics a line at a time
+void stats_log() {
+	char *text = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&text, &len);
+	if (!out)
+		return;
+	stats_print(out);
+	fclose(out);
+
+	for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+		if (daemonised) {
+			syslog(LOG_INFO, "%s", line);
+		} else {
+			fprintf(stderr, "%s\n", line);
+		}
+	}
+	free(text);
+}
+
+// (re)build the precomputed replies; drops everything cached, as the defaults may have changed
+bool responses_init() {
+	pthread_mutex_lock(&cache_lock);
+	cache_write_begin();
+	responses_fixed = 0;
+	bool ok = cache_init();
+	cache_generation++;
+	if (ok) {
+		const char *not_found = "user not found\n";
+		response_not_found = response_add(not_found, strlen(not_found));
+		response_default = response_add(config.default_pronouns, strlen(config.default_pronouns));
+		ok = response_not_found != UINT32_MAX && response_default != UINT32_MAX;
+		responses_fixed = responses->used;
+		cache.values[VALUE_NOT_FOUND].response = response_not_found;
+		cache.values[VALUE_DEFAULT].response = response_default;
+	}
+	cache_write_end();
+	pthread_mutex_unlock(&cache_lock);
+	return ok;
+}
+
+enum LookupResult {
+	LOOKUP_NOT_FOUND,   // no such user
+	LOOKUP_DEFAULT,     // user exists, but has no (or an empty) pronouns file
+	LOOKUP_FOUND,       // pronouns were read into the value buffer
+	LOOKUP_UNAVAILABLE, // the user's home is on a mount that is timing out, keep what we had
+};
+
+/*
+ * the slow path: NSS and the user's pronouns file
+ * touches no shared state, so it runs without holding any lock
+ */
+bool lookup_home(const char *input, char *home, size_t size) {
+	struct passwd pw;
+	char pw_buf[1024];
+	uint64_t started = monotonic_ns();
+	bool found = resolve(input, &pw, pw_buf, sizeof(pw_buf));
+	trace_stage(STAGE_RESOLVE, started, monotonic_ns());
+	if (!found)
+		return false;
+	snprintf(home, size, "%s", pw.pw_dir);
+	return true;
+}
+
+enum LookupResult lookup_file(const char *home, char *value, size_t size) {
+	char file_path[256];
+	snprintf(file_path, sizeof(file_path), "%s/%s", home, config.file_path);
+
+	uint64_t started = monotonic_ns();
+	FILE *file = fopen(file_path, "r");
+	uint64_t opened = monotonic_ns();
+	trace_stage(STAGE_OPEN, started, opened);
+	if (!file) {
+		return LOOKUP_DEFAULT;
+	}
+
+	enum LookupResult result = LOOKUP_DEFAULT; // return default if file is empty
+	bool read = fgets(value, size, file) != NULL;
+	trace_stage(STAGE_FILE_READ, opened, monotonic_ns());
+	if (read) {
+		char *cleaned = strip_in_place(value);
+		if (*cleaned) {
+			memmove(value, cleaned, strlen(cleaned) + 1);
+			result = LOOKUP_FOUND;
+		}
+	}
+
+	fclose(file);
+	return result;
+}
+
+enum LookupResult lookup(const char *input, char *value, size_t size) {
+	char home[256];
+	if (!lookup_home(input, home, sizeof(home)))
+		return LOOKUP_NOT_FOUND;
+	return lookup_file(home, value, size);
+}
+
+/*
+ * circuit breaker for home directory mounts
+ * when a lookup under a mount times out, files under it aren't opened again for breaker_cooldown seconds, so a dead
+ * NFS server can't tie up a thread per query; the mount is approximated by the directory holding the home directory
+ * once the cooldown is over, one lookup is let through to probe the mount, and the others are still skipped until it
+ * has answered, so a mount that is still dead only costs one more thread; the mount of each key looked up is
+ * remembered, so a request for a user under an open breaker is answered from the cache without queueing a lookup
+ */
+struct Breaker {
+	char mount[128];
+	time_t open_until;
+	bool probing; // a lookup under the mount is running since the cooldown ended
+};
+
+#define BREAKERS 16
+#define MOUNT_MEMO 4096 // keys whose mount is remembered, direct-mapped by hash
+#define MOUNTS 64       // distinct mounts remembered
+
+struct Breaker breakers[BREAKERS];
+pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct MountMemo {
+	uint32_t hash;
+	uint32_t mount; // index in mounts, plus one; 0 for nothing remembered
+};
+
+struct MountMemo mount_memo[MOUNT_MEMO];
+char mounts[MOUNTS][128];
+int mount_count = 0;
+
+void home_mount(const char *home, char *mount, size_t size) {
+	const char *slash = strrchr(home, '/');
+	size_t len = slash && slash != home ? (size_t)(slash - home) : 1;
+	if (len >= size)
+		len = size - 1;
+	memcpy(mount, home, len);
+	mount[len] = '\0';
+}
+
+// whether lookups under mount are skipped; the first caller after the cooldown is let through as the probe
+bool breaker_open(const char *mount) {
+	bool open = false;
+	pthread_mutex_lock(&breaker_lock);
+	time_t now = monotonic_seconds();
+	for (int i = 0; i < BREAKERS; i++) {
+		if (!breakers[i].open_until || strcmp(breakers[i].mount, mount) != 0)
+			continue;
+		if (breakers[i].open_until > now || breakers[i].probing)
+			open = true;
+		else
+			breakers[i].probing = true;
+		break;
+	}
+	pthread_mutex_unlock(&breaker_lock);
+	return open;
+}
+
+// a lookup under mount answered; a breaker that was being probed closes
+void breaker_close(const char *mount) {
+	pthread_mutex_lock(&breaker_lock);
+	time_t now = monotonic_seconds();
+	for (int i = 0; i < BREAKERS; i++) {
+		if (breakers[i].open_until && breakers[i].open_until <= now && strcmp(breakers[i].mount, mount) == 0) {
+			breakers[i].open_until = 0;
+			breakers[i].probing = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&breaker_lock);
+}
+
+// a lookup let through as the probe never got as far as the mount; the next caller probes instead
+void breaker_release(const char *mount) {
+	pthread_mutex_lock(&breaker_lock);
+	for (int i = 0; i < BREAKERS; i++) {
+		if (breakers[i].open_until && strcmp(breakers[i].mount, mount) == 0) {
+			breakers[i].probing = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&breaker_lock);
+}
+
+// remember which mount a key's home is under
+void mount_note(uint32_t hash, const char *mount) {
+	pthread_mutex_lock(&breaker_lock);
+	int i = 0;
+	while (i < mount_count && strcmp(mounts[i], mount) != 0)
+		i++;
+	if (i == mount_count && mount_count < MOUNTS)
+		snprintf(mounts[mount_count++], sizeof(mounts[0]), "%s", mount);
+	struct MountMemo *memo = &mount_memo[hash % MOUNT_MEMO];
+	memo->hash = hash;
+	memo->mount = i < mount_count ? (uint32_t)i + 1 : 0;
+	pthread_mutex_unlock(&breaker_lock);
+}
+
+// whether the key with this hash was last found under a mount whose breaker is open, without probing it
+bool mount_skipped(uint32_t hash) {
+	bool skipped = false;
+	pthread_mutex_lock(&breaker_lock);
+	const struct MountMemo *memo = &mount_memo[hash % MOUNT_MEMO];
+	if (memo->mount && memo->hash == hash) {
+		time_t now = monotonic_seconds();
+		const char *mount = mounts[memo->mount - 1];
+		for (int i = 0; i < BREAKERS && !skipped; i++) {
+			skipped = breakers[i].open_until && (breakers[i].open_until > now || breakers[i].probing) &&
+			          strcmp(breakers[i].mount, mount) == 0;
+		}
+	}
+	pthread_mutex_unlock(&breaker_lock);
+	return skipped;
+}
+
+void breaker_trip(const char *mount) {
+	pthread_mutex_lock(&breaker_lock);
+	struct Breaker *slot = &breakers[0];
+	for (int i = 0; i < BREAKERS; i++) {
+		if (strcmp(breakers[i].mount, mount) == 0) {
+			slot = &breakers[i];
+			break;
+		}
+		if (breakers[i].open_until < slot->open_until)
+			slot = &breakers[i]; // reuse whichever closes soonest
+	}
+	snprintf(slot->mount, sizeof(slot->mount), "%s", mount);
+	slot->open_until = monotonic_seconds() + config.breaker_cooldown;
+	slot->probing = false;
+	pthread_mutex_unlock(&breaker_lock);
+
+	if (daemonised) {
+		syslog(LOG_WARNING, "lookups under %s timed out, skipping it for %d seconds", mount, config.breaker_cooldown);
+	} else {
+		fprintf(stderr, "lookups under %s timed out, skipping it for %d seconds\n", mount, config.breaker_cooldown);
+	}
+}
+
+/*
+ * proxy mode
+ * with upstream lines in the config, a query for user@host is answered by asking the pronound configured as host for
+ * user, and the reply cached and the lookup shared like any other, so one proxy can answer for a federation of hosts
+ *
+ * with shard lines, queries for plain users are spread over the shards instead, each user going to the shard that
+ * scores highest for them under rendezvous hashing, so each shard's cache only holds its own users, and adding or
+ * removing a shard only moves the users of that shard; a shard is a backend and its replicas, all serving the same
+ * users, and a lookup goes to the first of them that is healthy
+ *
+ * connections to an upstream are kept in a small pool and reused, which needs keepalive set on the upstream; one
+ * that turns out to have been closed in the meantime is replaced by a fresh connection; no more than
+ * upstream_connections are open to an upstream at once, idle or not, as one too old to park idle connections gives
+ * each a worker of its own, so a lookup finding them all in use waits for one, and if none comes back in time is
+ * answered from the cache without that counting against the upstream; an upstream that fails or times out has its
+ * breaker tripped, and its users are answered from the cache until it closes, while a shard backend
+ * that fails is marked down until a health check, every health_interval seconds, gets an answer from it again
+ */
+#define UPSTREAM_MAX 64 // most connections open to one upstream, however many upstream_connections allows
+#define HEALTH_REQUEST ":PING" // a colon separates passwd fields, so no user can be called this
+#define HEALTH_REPLY "PONG\n"
+
+struct Upstream {
+	char *name; // the host queries ask for, or for a shard backend, its address as configured
+	char *address; // as configured, split in place into host and port
+	char *host;
+	char *port;
+	int shard;       // the shard served, -1 for an upstream for a host
+	uint32_t id;     // hash of name; a shard's first backend's identifies the shard for rendezvous hashing
+	bool healthy;    // for shard backends: answered the last lookup or health check
+	pthread_mutex_t lock;
+	pthread_cond_t returned; // a connection went back to the pool, or was closed
+	int idle[UPSTREAM_MAX];
+	int idle_count;
+	int open; // connections, idle or in use
+};
+
+enum UpstreamAnswer {
+	UPSTREAM_ANSWERED,
+	UPSTREAM_FAILED, // couldn't be reached, or didn't answer
+	UPSTREAM_BUSY,   // every connection it may have was in use until the deadline
+};
+
+// the upstreams and shards from the config, replaced as a whole on SIGHUP and freed once no lookup is using them
+struct Upstreams {
+	int refs;
+	int count;
+	int shard_count;
+	struct Upstream upstream[]; // the backends of each shard are together, first backend first
+};
+
+struct Upstreams *upstreams = NULL;
+pthread_mutex_t upstreams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// split <address>[:<port>], with an IPv6 address in brackets, in place; port is left alone, and false returned, if none
+bool address_split(char *address, char **host, char **port) {
+	*host = address;
+	char *colon = strrchr(address, ':');
+	if (address[0] == '[') {
+		char *close = strchr(address, ']');
+		if (close) {
+			*close = '\0';
+			*host = address + 1;
+			if (close[1] == ':') {
+				*port = close + 2;
+				return true;
+			}
+		}
+	} else if (colon && strchr(address, ':') == colon) {
+		*colon = '\0';
+		*port = colon + 1;
+		return true;
+	}
+	return false;
+}
+
+// add an upstream to a set being parsed; takes name and address, which are left to the caller if it fails
+bool upstream_add(struct Upstreams **set, char *name, char *address, int shard) {
+	int count = *set ? (*set)->count : 0;
+	struct Upstreams *grown = realloc(*set, sizeof(struct Upstreams) + (count + 1) * sizeof(struct Upstream));
+	if (!grown)
+		return false;
+	if (!*set) {
+		grown->refs = 1; // the reference held by upstreams
+		grown->shard_count = 0;
+	}
+	grown->count = count + 1;
+	*set = grown;
+
+	struct Upstream *upstream = &grown->upstream[count];
+	memset(upstream, 0, sizeof(*upstream));
+	upstream->name = name;
+	upstream->address = address;
+	upstream->id = hash_string(name);
+	upstream->shard = shard;
+	upstream->healthy = true;
+	upstream->port = "731";
+	address_split(address, &upstream->host, &upstream->port);
+	return true;
+}
+
+// an upstream line: <host> <address>[:<port>]
+bool upstream_parse(struct Upstreams **set, const char *value) {
+	char *name, *address;
+	if (!value || !split_first_space(value, &name, &address))
+		return false;
+	if (!name || !address) {
+		fprintf(stderr, "upstream needs a host and an address\n");
+		free(name);
+		free(address);
+		return false;
+	}
+	if (!upstream_add(set, name, address, -1)) {
+		free(name);
+		free(address);
+		return false;
+	}
+	return true;
+}
+
+// a shard line: <address>[:<port>] [<replica address>[:<port>]...]
+bool shard_parse(struct Upstreams **set, const char *value) {
+	char *rest = value ? strdup(value) : NULL;
+	if (!rest || !*rest) {
+		fprintf(stderr, "shard needs an address\n");
+		free(rest);
+		return false;
+	}
+	int shard = *set ? (*set)->shard_count : 0;
+	int added = 0;
+	char *save;
+	for (char *address = strtok_r(rest, " \t", &save); address; address = strtok_r(NULL, " \t", &save)) {
+		char *name = strdup(address);
+		char *copy = strdup(address);
+		if (!name || !copy || !upstream_add(set, name, copy, shard)) {
+			free(name);
+			free(copy);
+			free(rest);
+			return false;
+		}
+		added++;
+	}
+	free(rest);
+	if (!added) {
+		fprintf(stderr, "shard needs an address\n");
+		return false;
+	}
+	(*set)->shard_count = shard + 1;
+	return true;
+}
+
+// free a set, whether it was ever swapped in or only parsed
+void upstreams_free(struct Upstreams *set) {
+	for (int i = 0; set && i < set->count; i++) {
+		free(set->upstream[i].name);
+		free(set->upstream[i].address);
+	}
+	free(set);
+}
+
+struct Upstreams *upstreams_get() {
+	pthread_mutex_lock(&upstreams_lock);
+	struct Upstreams *set = upstreams;
+	if (set)
+		set->refs++;
+	pthread_mutex_unlock(&upstreams_lock);
+	return set;
+}
+
+void upstreams_put(struct Upstreams *set) {
+	if (!set)
+		return;
+	pthread_mutex_lock(&upstreams_lock);
+	bool last = --set->refs == 0;
+	pthread_mutex_unlock(&upstreams_lock);
+	if (!last)
+		return;
+	for (int i = 0; i < set->count; i++) {
+		for (int j = 0; j < set->upstream[i].idle_count; j++)
+			close(set->upstream[i].idle[j]);
+		pthread_mutex_destroy(&set->upstream[i].lock);
+		pthread_cond_destroy(&set->upstream[i].returned);
+	}
+	upstreams_free(set);
+}
+
+void upstreams_swap(struct Upstreams *set) {
+	// the locks only start once the set has stopped moving about in realloc
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (int i = 0; set && i < set->count; i++) {
+		pthread_mutex_init(&set->upstream[i].lock, NULL);
+		pthread_cond_init(&set->upstream[i].returned, &attr);
+	}
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_lock(&upstreams_lock);
+	struct Upstreams *old = upstreams;
+	upstreams = set;
+	pthread_mutex_unlock(&upstreams_lock);
+	upstreams_put(old);
+}
+
+// wait for fd to be ready for events until deadline (monotonic_ns), or for ever with lookup_timeout 0
+bool upstream_wait(int fd, short events, uint64_t deadline) {
+	struct pollfd pfd = {.fd = fd, .events = events};
+	while (true) {
+		int timeout = -1;
+		if (config.lookup_timeout > 0) {
+			uint64_t now = monotonic_ns();
+			if (now >= deadline)
+				return false;
+			timeout = (int)((deadline - now + 999999) / 1000000);
+		}
+		int ready = poll(&pfd, 1, timeout);
+		if (ready > 0)
+			return true;
+		if (ready == 0 || errno != EINTR)
+			return false;
+	}
+}
+
+int upstream_connect(const struct Upstream *upstream, uint64_t deadline) {
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res;
+	if (getaddrinfo(upstream->host, upstream->port, &hints, &res) != 0)
+		return -1;
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		int err = 0;
+		socklen_t len = sizeof(err);
+		bool connecting = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS;
+		if (!connecting || !upstream_wait(fd, POLLOUT, deadline) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+		    err) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	return fd;
+}
+
+// close a connection taken from upstream, making room for another
+void upstream_drop(struct Upstream *upstream, int fd) {
+	if (fd >= 0)
+		close(fd);
+	pthread_mutex_lock(&upstream->lock);
+	upstream->open--;
+	pthread_cond_signal(&upstream->returned);
+	pthread_mutex_unlock(&upstream->lock);
+}
+
+/*
+ * a connection to upstream: an idle one from the pool if one is still open, with pooled set, or a new one if there is
+ * room for it; with none to spare, waits until deadline for one to be given back, after which a new connection still
+ * gets the whole of lookup_timeout, as the wait was none of the upstream's doing
+ * returns -1 if a new connection failed, or UPSTREAM_BUSY_FD if none could be had in time
+ */
+#define UPSTREAM_BUSY_FD -2
+int upstream_take(struct Upstream *upstream, uint64_t deadline, bool *pooled) {
+	int limit = config.upstream_limit < 1 ? 1 : config.upstream_limit;
+	if (limit > UPSTREAM_MAX)
+		limit = UPSTREAM_MAX;
+	struct timespec until = {.tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000};
+	pthread_mutex_lock(&upstream->lock);
+	while (true) {
+		while (upstream->idle_count) {
+			int fd = upstream->idle[--upstream->idle_count];
+			// an idle connection has nothing to read, unless the upstream has closed it
+			char byte;
+			if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+				pthread_mutex_unlock(&upstream->lock);
+				*pooled = true;
+				return fd;
+			}
+			close(fd);
+			upstream->open--;
+		}
+		if (upstream->open < limit)
+			break;
+		if (config.lookup_timeout <= 0) {
+			pthread_cond_wait(&upstream->returned, &upstream->lock);
+		} else if (pthread_cond_timedwait(&upstream->returned, &upstream->lock, &until) == ETIMEDOUT) {
+			pthread_mutex_unlock(&upstream->lock);
+			return UPSTREAM_BUSY_FD;
+		}
+	}
+	upstream->open++;
+	pthread_mutex_unlock(&upstream->lock);
+
+	*pooled = false;
+	int fd = upstream_connect(upstream, monotonic_ns() + (uint64_t)config.lookup_timeout * 1000000);
+	if (fd < 0)
+		upstream_drop(upstream, -1);
+	return fd;
+}
+
+void upstream_give(struct Upstream *upstream, int fd) {
+	pthread_mutex_lock(&upstream->lock);
+	if (upstream->idle_count < UPSTREAM_MAX) {
+		upstream->idle[upstream->idle_count++] = fd;
+		fd = -1;
+		pthread_cond_signal(&upstream->returned);
+	}
+	pthread_mutex_unlock(&upstream->lock);
+	if (fd >= 0)
+		upstream_drop(upstream, fd);
+}
+
+/*
+ * ask one connection for user, reading the reply line into value; false if the connection failed, in which case it is
+ * closed, else it goes back to the pool if the upstream kept it open
+ */
+bool upstream_ask(struct Upstream *upstream, int fd, const char *user, char *value, size_t size, uint64_t deadline) {
+	char request[256];
+	int len = snprintf(request, sizeof(request), "%s\n", user);
+	if (len < 0 || (size_t)len >= sizeof(request) || send(fd, request, len, MSG_NOSIGNAL) != len) {
+		upstream_drop(upstream, fd);
+		return false;
+	}
+
+	size_t got = 0;
+	bool truncated = false;
+	while (true) {
+		char buffer[512];
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EAGAIN && upstream_wait(fd, POLLIN, deadline))
+			continue;
+		if (n <= 0) {
+			// an upstream without keepalive answers a lone query and closes, which is a reply all the same
+			if (n == 0 && got) {
+				value[got] = '\0';
+				upstream_drop(upstream, fd);
+				return true;
+			}
+			upstream_drop(upstream, fd);
+			return false;
+		}
+		char *newline = memchr(buffer, '\n', n);
+		size_t take = newline ? (size_t)(newline - buffer) : (size_t)n;
+		if (got + take >= size) {
+			take = size - 1 - got;
+			truncated = true;
+		}
+		memcpy(value + got, buffer, take);
+		got += take;
+		if (newline) {
+			value[got] = '\0';
+			// anything after the reply means the connection is out of step with its queries
+			if (newline + 1 < buffer + n || truncated)
+				upstream_drop(upstream, fd);
+			else
+				upstream_give(upstream, fd);
+			return true;
+		}
+	}
+}
+
+// ask the upstream for user, over a pooled connection or a new one
+enum UpstreamAnswer upstream_query(struct Upstream *upstream, const char *user, char *value, size_t size) {
+	uint64_t timeout = (uint64_t)config.lookup_timeout * 1000000;
+	uint64_t deadline = monotonic_ns() + timeout;
+	// a pooled connection may have been closed since it was checked, so a failure on one is retried on another
+	for (int attempt = 0; attempt < 2; attempt++) {
+		bool pooled = false;
+		int fd = upstream_take(upstream, deadline, &pooled);
+		if (fd == UPSTREAM_BUSY_FD)
+			return UPSTREAM_BUSY;
+		if (fd < 0)
+			return UPSTREAM_FAILED;
+		// only the upstream's own time counts against it
+		if (upstream_ask(upstream, fd, user, value, size, monotonic_ns() + timeout))
+			return UPSTREAM_ANSWERED;
+		if (!pooled)
+			break;
+	}
+	return UPSTREAM_FAILED;
+}
+
+void upstream_health(struct Upstream *upstream, bool healthy) {
+	if (__atomic_exchange_n(&upstream->healthy, healthy, __ATOMIC_RELAXED) == healthy)
+		return;
+	if (daemonised) {
+		syslog(LOG_WARNING, "shard %d backend %s is %s", upstream->shard, upstream->name, healthy ? "up" : "down");
+	} else {
+		fprintf(stderr, "shard %d backend %s is %s\n", upstream->shard, upstream->name, healthy ? "up" : "down");
+	}
+}
+
+// mixes a shard's id with a user's hash into the shard's score for the user
+uint64_t rendezvous_score(uint32_t shard, uint32_t user) {
+	uint64_t x = ((uint64_t)shard << 32 | user) + 0x9e3779b97f4a7c15ULL; // splitmix64
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// the backends that can answer for query, in the order to try them, and the user to ask them for
+int upstream_candidates(struct Upstreams *set, const char *query, struct Upstream **candidates, char *user,
+                        size_t user_size) {
+	const char *at = strrchr(query, '@');
+	int count = 0;
+	if (at) {
+		for (int i = 0; i < set->count && count == 0; i++) {
+			if (set->upstream[i].shard < 0 && strcmp(set->upstream[i].name, at + 1) == 0)
+				candidates[count++] = &set->upstream[i];
+		}
+		snprintf(user, user_size, "%.*s", (int)(at - query), query);
+		return at == query ? 0 : count;
+	}
+
+	uint32_t hash = hash_string(query);
+	int best = -1;
+	uint64_t best_score = 0;
+	for (int i = 0; i < set->count; i++) {
+		struct Upstream *upstream = &set->upstream[i];
+		if (upstream->shard < 0 || (i > 0 && set->upstream[i - 1].shard == upstream->shard))
+			continue; // only the first backend of each shard
+		uint64_t score = rendezvous_score(upstream->id, hash);
+		if (best < 0 || score > best_score) {
+			best = upstream->shard;
+			best_score = score;
+		}
+	}
+	for (int i = 0; i < set->count; i++) {
+		if (set->upstream[i].shard == best && __atomic_load_n(&set->upstream[i].healthy, __ATOMIC_RELAXED))
+			candidates[count++] = &set->upstream[i];
+	}
+	snprintf(user, user_size, "%s", query);
+	return count;
+}
+
+/*
+ * look a query up upstream: user@host on the upstream for host, or a plain user on their shard; mount is set to name
+ * an upstream for the breaker
+ * returns LOOKUP_NOT_FOUND for a host that isn't an upstream, and LOOKUP_UNAVAILABLE if nothing that could answer
+ * can be reached
+ */
+enum LookupResult upstream_lookup(struct Upstreams *set, const char *query, char *value, size_t size, char *mount,
+                                  size_t mount_size) {
+	struct Upstream *candidates[set->count];
+	char user[256];
+	int count = upstream_candidates(set, query, candidates, user, sizeof(user));
+	if (count == 0)
+		return strchr(query, '@') || set->shard_count == 0 ? LOOKUP_NOT_FOUND : LOOKUP_UNAVAILABLE;
+
+	bool named = candidates[0]->shard < 0;
+	if (named) {
+		snprintf(mount, mount_size, "upstream %s", candidates[0]->name);
+		if (breaker_open(mount))
+			return LOOKUP_UNAVAILABLE;
+	}
+
+	uint64_t started = monotonic_ns();
+	enum UpstreamAnswer answer = UPSTREAM_FAILED;
+	for (int i = 0; i < count && answer != UPSTREAM_ANSWERED; i++) {
+		answer = upstream_query(candidates[i], user, value, size);
+		// a backend that was only busy is as healthy as it was
+		if (!named && answer != UPSTREAM_BUSY)
+			upstream_health(candidates[i], answer == UPSTREAM_ANSWERED);
+	}
+	trace_stage(STAGE_RESOLVE, started, monotonic_ns());
+
+	if (answer != UPSTREAM_ANSWERED) {
+		if (named && answer == UPSTREAM_FAILED)
+			breaker_trip(mount);
+		else if (named)
+			breaker_release(mount);
+		return LOOKUP_UNAVAILABLE;
+	}
+	if (named)
+		breaker_close(mount);
+	// cache the upstream's reply as it is, whatever it says, rather than the default for an empty one
+	char *cleaned = strip_in_place(value);
+	memmove(value, cleaned, strlen(cleaned) + 1);
+	return LOOKUP_FOUND;
+}
+
+/*
+ * check every shard backend every health_interval seconds, so one that was down is used again; the check is a :PING,
+ * answered by a pronound without looking anything up, which one too old to know it looks up as a user, and answers
+ * all the same
+ */
+void *health_checker(void *arg) {
+	(void)arg;
+	while (true) {
+		sleep(config.health_interval > 0 ? config.health_interval : 1);
+		struct Upstreams *set = upstreams_get();
+		for (int i = 0; set && i < set->count; i++) {
+			char value[256];
+			if (set->upstream[i].shard < 0)
+				continue;
+			enum UpstreamAnswer answer = upstream_query(&set->upstream[i], HEALTH_REQUEST, value, sizeof(value));
+			if (answer != UPSTREAM_BUSY)
+				upstream_health(&set->upstream[i], answer == UPSTREAM_ANSWERED);
+		}
+		upstreams_put(set);
+	}
+	return NULL;
+}
+
+bool health_started = false;
+
+// start health checks once there are shards to check, at startup or on a reload that adds them
+bool health_start() {
+	struct Upstreams *set = upstreams_get();
+	bool shards = set && set->shard_count;
+	upstreams_put(set);
+	if (!shards || health_started)
+		return true;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, health_checker, NULL) != 0)
+		return false;
+	pthread_detach(thread);
+	health_started = true;
+	return true;
+}
+
+/*
+ * snapshot replication
+ * a primary, with snapshot_serve set, looks every user up every snapshot_interval seconds and compiles the replies
+ * into a snapshot: one block holding a hash table of names and uids, and the replies for them; replicas, with
+ * replicate set, fetch it whenever it has changed, write it to snapshot_file, and map that in place of the one before,
+ * answering from it instead of looking users up themselves, so only the primary reads home directories
+ * a replica sends the generation it has, a hash of the snapshot's contents, and gets back the primary's snapshot, or
+ * nothing if that is the same one; a replica answers locally until it has a snapshot, maps the one it had on startup,
+ * and can serve what it fetched on to replicas of its own
+ */
+#define SNAPSHOT_MAGIC "pronsnp1"
+#define SNAPSHOT_TIMEOUT_MS 10000 // how long a replica waits on the primary for each part of a snapshot
+
+struct SnapshotHeader {
+	char magic[8];
+	uint64_t generation; // hash of everything after the header
+	uint64_t size;       // of the whole snapshot, header included
+	uint32_t buckets;    // power of two, with at least one empty
+	uint32_t count;
+};
+
+// offsets into the snapshot; key 0 is an empty bucket, value 0 a user without pronouns
+struct SnapshotEntry {
+	uint32_t hash;
+	uint32_t key;
+	uint32_t value;
+};
+
+// the current snapshot, replaced as a whole and freed or unmapped once no lookup or replica is using it
+struct Snapshot {
+	int refs;
+	const struct SnapshotHeader *header;
+	size_t size;
+	bool mapped; // from snapshot_file, rather than built here
+};
+
+struct Snapshot *snapshot = NULL;
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+int snapshot_sockfd = -1;
+
+struct Snapshot *snapshot_get() {
+	pthread_mutex_lock(&snapshot_lock);
+	struct Snapshot *current = snapshot;
+	if (current)
+		current->refs++;
+	pthread_mutex_unlock(&snapshot_lock);
+	return current;
+}
+
+void snapshot_put(struct Snapshot *current) {
+	if (!current)
+		return;
+	pthread_mutex_lock(&snapshot_lock);
+	bool last = --current->refs == 0;
+	pthread_mutex_unlock(&snapshot_lock);
+	if (!last)
+		return;
+	if (current->mapped)
+		munmap((void *)current->header, current->size);
+	else
+		free((void *)current->header);
+	free(current);
+}
+
+// takes over data, and the reference in it
+void snapshot_swap(const void *data, size_t size, bool mapped) {
+	struct Snapshot *replacement = malloc(sizeof(struct Snapshot));
+	if (!replacement) {
+		if (mapped)
+			munmap((void *)data, size);
+		else
+			free((void *)data);
+		return;
+	}
+	*replacement = (struct Snapshot){.refs = 1, .header = data, .size = size, .mapped = mapped};
+	pthread_mutex_lock(&snapshot_lock);
+	struct Snapshot *old = snapshot;
+	snapshot = replacement;
+	pthread_mutex_unlock(&snapshot_lock);
+	snapshot_put(old);
+}
+
+uint64_t snapshot_hash(const char *data, size_t len) {
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a, 64 bit
+	while (len--) {
+		hash ^= (unsigned char)*data++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// whether data is a whole snapshot that lookups can't run off the end of
+bool snapshot_valid(const void *data, size_t size) {
+	const struct SnapshotHeader *header = data;
+	if (size < sizeof(*header) || size > UINT32_MAX || memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+	    header->size != size)
+		return false;
+	if (header->buckets == 0 || (header->buckets & (header->buckets - 1)) || header->count >= header->buckets)
+		return false;
+	size_t strings = sizeof(*header) + (size_t)header->buckets * sizeof(struct SnapshotEntry);
+	if (strings > size || ((const char *)data)[size - 1] != '\0')
+		return false;
+	const struct SnapshotEntry *entries = (const void *)(header + 1);
+	uint32_t occupied = 0;
+	for (uint32_t i = 0; i < header->buckets; i++) {
+		if ((entries[i].key && (entries[i].key < strings || entries[i].key >= size)) ||
+		    (entries[i].value && (entries[i].value < strings || entries[i].value >= size)))
+			return false;
+		occupied += entries[i].key != 0;
+	}
+	// a probe only ends at an empty bucket, so a table without one would never let a miss finish
+	if (occupied != header->count)
+		return false;
+	return header->generation == snapshot_hash((const char *)data + sizeof(*header), size - sizeof(*header));
+}
+
+// a query's answer from a snapshot, as lookup() would give it
+enum LookupResult snapshot_lookup(const struct Snapshot *current, const char *query, char *value, size_t size) {
+	const char *base = (const char *)current->header;
+	const struct SnapshotEntry *entries = (const void *)(current->header + 1);
+	uint32_t mask = current->header->buckets - 1;
+	uint32_t hash = hash_string(query);
+	for (uint32_t i = hash & mask, probes = 0; entries[i].key && probes <= mask; i = (i + 1) & mask, probes++) {
+		if (entries[i].hash != hash || strcmp(base + entries[i].key, query) != 0)
+			continue;
+		if (!entries[i].value)
+			return LOOKUP_DEFAULT;
+		snprintf(value, size, "%s", base + entries[i].value);
+		return LOOKUP_FOUND;
+	}
+	return LOOKUP_NOT_FOUND;
+}
+
+struct SnapshotUser {
+	char *name;
+	char *dir;
+	char uid[16];
+	char *reply;      // NULL for none
+	bool unavailable; // under a mount whose breaker is open, or whose lookup was given up on
+};
+
+void snapshot_users_free(struct SnapshotUser *users, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		free(users[i].name);
+		free(users[i].dir);
+		free(users[i].reply);
+	}
+	free(users);
+}
+
+// every user, from the passwd file or NSS; NULL if there's no memory
+struct SnapshotUser *snapshot_users(size_t *count) {
+	struct SnapshotUser *users = NULL;
+	size_t size = 0;
+	*count = 0;
+	struct passwd pw, *result;
+	char buf[1024];
+	if (config.passwd_file) {
+		pthread_rwlock_rdlock(&fixture_lock);
+		size = fixture.count;
+		users = calloc(size ? size : 1, sizeof(struct SnapshotUser));
+		for (size_t i = 0; users && i < size; i++) {
+			users[i].name = strdup(fixture.by_name[i].name);
+			users[i].dir = strdup(fixture.by_name[i].dir);
+			snprintf(users[i].uid, sizeof(users[i].uid), "%u", (unsigned)fixture.by_name[i].uid);
+			*count = i + 1;
+		}
+		pthread_rwlock_unlock(&fixture_lock);
+	} else {
+		setpwent();
+		while (getpwent_r(&pw, buf, sizeof(buf), &result) == 0) {
+			if (*count == size) {
+				size = size ? size * 2 : 1024;
+				struct SnapshotUser *grown = realloc(users, size * sizeof(struct SnapshotUser));
+				if (!grown)
+					break;
+				users = grown;
+			}
+			struct SnapshotUser *user = &users[(*count)++];
+			user->name = strdup(pw.pw_name);
+			user->dir = strdup(pw.pw_dir);
+			user->reply = NULL;
+			user->unavailable = false;
+			snprintf(user->uid, sizeof(user->uid), "%u", (unsigned)pw.pw_uid);
+		}
+		endpwent();
+	}
+	for (size_t i = 0; users && i < *count; i++) {
+		if (!users[i].name || !users[i].dir) {
+			snapshot_users_free(users, *count);
+			return NULL;
+		}
+	}
+	return users;
+}
+
+// copy str into the snapshot at *offset; returns where it went
+uint32_t snapshot_string(char *data, size_t *offset, const char *str) {
+	uint32_t at = (uint32_t)*offset;
+	size_t len = strlen(str) + 1;
+	memcpy(data + at, str, len);
+	*offset += len;
+	return at;
+}
+
+// add key to the snapshot being built, unless it is already there, as a uid shared by several users can be
+void snapshot_insert(char *data, size_t *offset, const char *key, uint32_t value) {
+	struct SnapshotHeader *header = (struct SnapshotHeader *)data;
+	struct SnapshotEntry *entries = (struct SnapshotEntry *)(header + 1);
+	uint32_t mask = header->buckets - 1;
+	uint32_t hash = hash_string(key);
+	uint32_t i = hash & mask;
+	for (; entries[i].key; i = (i + 1) & mask) {
+		if (entries[i].hash == hash && strcmp(data + entries[i].key, key) == 0)
+			return;
+	}
+	entries[i] = (struct SnapshotEntry){.hash = hash, .key = snapshot_string(data, offset, key), .value = value};
+	header->count++;
+}
+
+/*
+ * a snapshot's lookups run on a thread of their own, which the builder waits on for at most lookup_timeout a user, as
+ * any of them can hang on a mount; the mount of a user whose lookup hangs has its breaker tripped, the thread is left
+ * to it, and a new one carries on from the next user, while users under a mount whose breaker is open aren't looked
+ * up at all; either way they keep the reply they had in the last snapshot
+ */
+struct SnapshotLookups {
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+	int refs; // the builder, and each thread yet to finish; the last frees the users
+	struct SnapshotUser *users;
+	size_t count;
+	size_t next;         // the user being looked up
+	uint64_t generation; // of the thread doing the lookups; any other has been given up on
+};
+
+struct SnapshotLooker {
+	struct SnapshotLookups *lookups;
+	uint64_t generation;
+};
+
+void snapshot_lookups_put(struct SnapshotLookups *lookups) {
+	pthread_mutex_lock(&lookups->lock);
+	bool last = --lookups->refs == 0;
+	pthread_mutex_unlock(&lookups->lock);
+	if (!last)
+		return;
+	snapshot_users_free(lookups->users, lookups->count);
+	pthread_cond_destroy(&lookups->progress);
+	pthread_mutex_destroy(&lookups->lock);
+	free(lookups);
+}
+
+void *snapshot_looker(void *arg) {
+	struct SnapshotLooker looker = *(struct SnapshotLooker *)arg;
+	free(arg);
+	struct SnapshotLookups *lookups = looker.lookups;
+	pthread_mutex_lock(&lookups->lock);
+	while (lookups->generation == looker.generation && lookups->next < lookups->count) {
+		struct SnapshotUser *user = &lookups->users[lookups->next];
+		pthread_mutex_unlock(&lookups->lock);
+
+		char mount[128], value[256];
+		home_mount(user->dir, mount, sizeof(mount));
+		enum LookupResult result = LOOKUP_UNAVAILABLE;
+		if (!breaker_open(mount)) {
+			result = lookup_file(user->dir, value, sizeof(value));
+			breaker_close(mount);
+		}
+
+		pthread_mutex_lock(&lookups->lock);
+		if (lookups->generation != looker.generation)
+			break; // given up on, and the user has been moved past
+		user->unavailable = result == LOOKUP_UNAVAILABLE;
+		if (result == LOOKUP_FOUND)
+			user->reply = strdup(value);
+		lookups->next++;
+		pthread_cond_signal(&lookups->progress);
+	}
+	pthread_mutex_unlock(&lookups->lock);
+	snapshot_lookups_put(lookups);
+	return NULL;
+}
+
+// start a thread looking users up from lookups->next, with lookups->lock held; false if it couldn't be
+bool snapshot_looker_start(struct SnapshotLookups *lookups) {
+	struct SnapshotLooker *looker = malloc(sizeof(struct SnapshotLooker));
+	if (!looker)
+		return false;
+	looker->lookups = lookups;
+	looker->generation = ++lookups->generation;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, snapshot_looker, looker) != 0) {
+		free(looker);
+		return false;
+	}
+	pthread_detach(thread);
+	lookups->refs++;
+	return true;
+}
+
+// look each user up, giving up on any that take longer than lookup_timeout; false if the lookups couldn't be run
+bool snapshot_lookup_all(struct SnapshotLookups *lookups) {
+	bool ok = true;
+	pthread_mutex_lock(&lookups->lock);
+	if (!snapshot_looker_start(lookups))
+		ok = false;
+	while (ok && lookups->next < lookups->count) {
+		size_t at = lookups->next;
+		if (config.lookup_timeout <= 0) {
+			pthread_cond_wait(&lookups->progress, &lookups->lock);
+			continue;
+		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += config.lookup_timeout / 1000;
+		deadline.tv_nsec += (long)(config.lookup_timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (lookups->next == at) {
+			if (pthread_cond_timedwait(&lookups->progress, &lookups->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (lookups->next != at)
+			continue;
+
+		struct SnapshotUser *user = &lookups->users[at];
+		char mount[128];
+		home_mount(user->dir, mount, sizeof(mount));
+		breaker_trip(mount);
+		user->unavailable = true;
+		lookups->next++;
+		ok = snapshot_looker_start(lookups);
+	}
+	pthread_mutex_unlock(&lookups->lock);
+	return ok;
+}
+
+// look every user up and compile the replies into a snapshot, of size bytes; NULL on failure
+char *snapshot_build(size_t *size) {
+	struct SnapshotLookups *lookups = calloc(1, sizeof(struct SnapshotLookups));
+	if (!lookups)
+		return NULL;
+	lookups->users = snapshot_users(&lookups->count);
+	if (!lookups->users) {
+		free(lookups);
+		return NULL;
+	}
+	lookups->refs = 1;
+	pthread_mutex_init(&lookups->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&lookups->progress, &attr);
+	pthread_condattr_destroy(&attr);
+	if (!snapshot_lookup_all(lookups)) {
+		snapshot_lookups_put(lookups);
+		return NULL;
+	}
+
+	// once the last user is done, a thread given up on only ever looks at the user it was stuck on
+	struct SnapshotUser *users = lookups->users;
+	size_t count = lookups->count;
+	struct Snapshot *previous = snapshot_get();
+	size_t strings = 0;
+	for (size_t i = 0; i < count; i++) {
+		char value[256];
+		if (users[i].unavailable && previous &&
+		    snapshot_lookup(previous, users[i].name, value, sizeof(value)) == LOOKUP_FOUND)
+			users[i].reply = strdup(value);
+		strings += strlen(users[i].name) + 1 + strlen(users[i].uid) + 1;
+		strings += users[i].reply ? strlen(users[i].reply) + 1 : 0;
+	}
+
+	// a name and a uid for each user, the table kept at most half full
+	uint32_t buckets = 16;
+	while (buckets < count * 4 && buckets < (1u << 30))
+		buckets *= 2;
+	size_t offset = sizeof(struct SnapshotHeader) + (size_t)buckets * sizeof(struct SnapshotEntry);
+	*size = offset + strings + 1; // and a final byte, so even an empty snapshot ends in a nul
+	char *data = *size <= UINT32_MAX && count * 2 < buckets ? calloc(1, *size) : NULL;
+	if (data) {
+		struct SnapshotHeader *header = (struct SnapshotHeader *)data;
+		memcpy(header->magic, SNAPSHOT_MAGIC, 8);
+		header->size = *size;
+		header->buckets = buckets;
+		for (size_t i = 0; i < count; i++) {
+			if (!*users[i].name)
+				continue;
+			uint32_t value = users[i].reply ? snapshot_string(data, &offset, users[i].reply) : 0;
+			snapshot_insert(data, &offset, users[i].name, value);
+			snapshot_insert(data, &offset, users[i].uid, value);
+		}
+		header->generation = snapshot_hash(data + sizeof(*header), *size - sizeof(*header));
+	}
+
+	snapshot_put(previous);
+	snapshot_lookups_put(lookups);
+	return data;
+}
+
+// on a primary, rebuild the snapshot every snapshot_interval seconds, keeping the old one if nothing changed
+void *snapshot_builder(void *arg) {
+	(void)arg;
+	while (true) {
+		size_t size;
+		char *data = snapshot_build(&size);
+		struct Snapshot *current = snapshot_get();
+		if (!data) {
+			error("failed to build snapshot");
+		} else if (current && current->header->generation == ((struct SnapshotHeader *)data)->generation) {
+			free(data);
+		} else {
+			snapshot_swap(data, size, false);
+		}
+		snapshot_put(current);
+		sleep(config.snapshot_interval > 0 ? config.snapshot_interval : 1);
+	}
+	return NULL;
+}
+
+// log what happened to the primary or a snapshot file, where errno would say nothing useful
+void replica_log(int priority, const char *msg, const char *where) {
+	if (daemonised) {
+		syslog(priority, "%s %s", msg, where);
+	} else {
+		fprintf(stderr, "%s %s\n", msg, where);
+	}
+}
+
+// map a snapshot file, and answer from it from now on
+bool snapshot_map(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	if (!snapshot_valid(data, st.st_size)) {
+		replica_log(LOG_ERR, "ignoring invalid snapshot", path);
+		munmap(data, st.st_size);
+		return false;
+	}
+	snapshot_swap(data, st.st_size, true);
+	return true;
+}
+
+// read exactly len bytes, waiting at most SNAPSHOT_TIMEOUT_MS for each part; returns how many there were before EOF
+ssize_t snapshot_read(int fd, char *buf, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		if (!upstream_wait(fd, POLLIN, monotonic_ns() + (uint64_t)SNAPSHOT_TIMEOUT_MS * 1000000))
+			return -1;
+		ssize_t n = read(fd, buf + got, len - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+/*
+ * fetch the primary's snapshot into snapshot_file, unless it is generation; true if a new one was written
+ * it is written beside the file and renamed over it, so the mapped one is never changed under a lookup
+ */
+bool snapshot_fetch(const char *primary, uint64_t generation) {
+	struct Upstream upstream = {0};
+	char *address = strdup(primary);
+	if (!address)
+		return false;
+	address_split(address, &upstream.host, &upstream.port);
+	int fd = upstream_connect(&upstream, monotonic_ns() + (uint64_t)SNAPSHOT_TIMEOUT_MS * 1000000);
+	free(address);
+	if (fd < 0) {
+		replica_log(LOG_WARNING, "could not connect to primary", primary);
+		return false;
+	}
+
+	char request[32];
+	int request_len = snprintf(request, sizeof(request), "%016llx\n", (unsigned long long)generation);
+	struct SnapshotHeader header;
+	ssize_t got = -1;
+	if (send(fd, request, request_len, MSG_NOSIGNAL) == request_len)
+		got = snapshot_read(fd, (char *)&header, sizeof(header));
+	if (got <= 0 || (size_t)got < sizeof(header) || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 ||
+	    header.size < sizeof(header) || header.size > UINT32_MAX) {
+		if (got != 0)
+			replica_log(LOG_WARNING, "no snapshot from primary", primary);
+		close(fd);
+		return false; // nothing sent means ours is current
+	}
+
+	char temp_path[1024];
+	snprintf(temp_path, sizeof(temp_path), "%s.new", config.snapshot_file);
+	int out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		error("could not write snapshot %s", temp_path);
+		close(fd);
+		return false;
+	}
+	bool written = write(out, &header, sizeof(header)) == sizeof(header);
+	char chunk[65536];
+	for (uint64_t left = header.size - sizeof(header); written && left > 0;) {
+		got = snapshot_read(fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+		written = got > 0 && write(out, chunk, got) == got;
+		left -= written ? (uint64_t)got : 0;
+	}
+	close(fd);
+	if (!written) {
+		replica_log(LOG_WARNING, "could not fetch snapshot from primary", primary);
+		close(out);
+		unlink(temp_path);
+		return false;
+	}
+	if (close(out) < 0 || rename(temp_path, config.snapshot_file) < 0) {
+		error("could not write snapshot %s", config.snapshot_file);
+		unlink(temp_path);
+		return false;
+	}
+	return true;
+}
+
+// on a replica, check the primary for a new snapshot every snapshot_interval seconds
+void *replicator(void *arg) {
+	(void)arg;
+	snapshot_map(config.snapshot_file); // whatever we had before a restart, until the primary answers
+	while (true) {
+		struct Snapshot *current = snapshot_get();
+		uint64_t generation = current ? current->header->generation : 0;
+		snapshot_put(current);
+		if (snapshot_fetch(config.replicate, generation) && snapshot_map(config.snapshot_file))
+			replica_log(LOG_INFO, "replicated snapshot from", config.replicate);
+		sleep(config.snapshot_interval > 0 ? config.snapshot_interval : 1);
+	}
+	return NULL;
+}
+
+// send a replica the snapshot, unless it already has it
+void snapshot_serve(int client_sock) {
+	char request[64];
+	struct timeval timeout = {1, 0}, send_timeout = {SNAPSHOT_TIMEOUT_MS / 1000, 0};
+	setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+	ssize_t len = read(client_sock, request, sizeof(request) - 1);
+	if (len < 0)
+		return;
+	request[len] = '\0';
+
+	struct Snapshot *current = snapshot_get();
+	if (current && strtoull(request, NULL, 16) != current->header->generation) {
+		const char *data = (const char *)current->header;
+		for (size_t sent = 0; sent < current->size;) {
+			ssize_t n = send(client_sock, data + sent, current->size - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			sent += n;
+		}
+	}
+	snapshot_put(current);
+}
+
+void *snapshot_listener(void *arg) {
+	(void)arg;
+	while (true) {
+		int client_sock = accept(snapshot_sockfd, NULL, NULL);
+		if (client_sock < 0)
+			continue;
+		snapshot_serve(client_sock);
+		close(client_sock);
+	}
+	return NULL;
+}
+
+/*
+ * turn a lookup result into an interned reply; cache_lock must be held
+ * returns NO_VALUE if there is no room even after compacting, the reply is then sent from *response but not cached
+ */
+uint32_t lookup_value(enum LookupResult result, const char *value, uint32_t *response) {
+	if (result == LOOKUP_NOT_FOUND || result == LOOKUP_DEFAULT) {
+		*response = result == LOOKUP_NOT_FOUND ? response_not_found : response_default;
+		return result == LOOKUP_NOT_FOUND ? VALUE_NOT_FOUND : VALUE_DEFAULT;
+	}
+
+	size_t len = strlen(value);
+	uint32_t id = value_intern(value, len);
+	if (id == NO_VALUE && values_compact())
+		id = value_intern(value, len);
+	if (id != NO_VALUE) {
+		*response = cache.values[id].response;
+		return id;
+	}
+
+	*response = response_add(value, len);
+	if (*response == UINT32_MAX)
+		*response = response_default;
+	return NO_VALUE;
+}
+
+enum ResultClass value_result(uint32_t id) {
+	return id == VALUE_NOT_FOUND ? RESULT_NOT_FOUND : id == VALUE_DEFAULT ? RESULT_DEFAULT : RESULT_FOUND;
+}
+
+// hand out a reply from the current table and drop cache_lock
+void reply_locked(uint32_t response, enum ResultClass result, struct Reply *reply) {
+	reply->table = responses;
+	__atomic_add_fetch(&responses->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache_lock);
+	reply->response = response_at(reply->table, response);
+	reply->result = result;
+}
+
+// the last reply we had for a query, even if expired, or the default; cache_lock must be held, and is dropped
+void reply_stale(const char *input, uint32_t hash, struct Reply *reply) {
+	struct CacheEntry *entry = cache_find(input, hash);
+	if (entry)
+		reply_locked(entry_response(entry), RESULT_STALE, reply);
+	else
+		reply_locked(response_default, RESULT_DEFAULT, reply);
+}
+
+void flight_free(struct Flight *flight) {
+	response_release(flight->table);
+	pthread_cond_destroy(&flight->cond);
+	free(flight->key);
+	free(flight);
+}
+
+// record the result of a flight and wake its waiters; cache_lock must be held
+void flight_finish(struct Flight *flight, enum LookupResult result, const char *value) {
+	if (result == LOOKUP_UNAVAILABLE) {
+		struct CacheEntry *entry = cache_find(flight->key, flight->hash);
+		flight->response = entry ? entry_response(entry) : response_default;
+		flight->result = entry ? RESULT_STALE : RESULT_DEFAULT;
+		flight->skipped = true;
+	} else {
+		cache_write_begin();
+		uint32_t id = lookup_value(result, value, &flight->response);
+		if (config.cache_ttl > 0 && id != NO_VALUE)
+			cache_store(flight->key, flight->hash, id);
+		cache_write_end();
+		flight->result = result == LOOKUP_NOT_FOUND ? RESULT_NOT_FOUND
+		                 : result == LOOKUP_FOUND   ? RESULT_FOUND
+		                                            : RESULT_DEFAULT;
+	}
+
+	for (struct Flight **link = &flights; *link; link = &(*link)->next) {
+		if (*link == flight) {
+			*link = flight->next;
+			break;
+		}
+	}
+
+	slow_lookup_note(flight->key, (uint32_t)((monotonic_ns() - flight->started) / 1000));
+	flight->done = true;
+	flight->table = responses;
+	__atomic_add_fetch(&responses->refs, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&flight->cond);
+	if (flight->waiters == 0)
+		flight_free(flight);
+}
+
+void *flight_run(void *arg) {
+	struct Flight *flight = arg;
+	char home[256];
+	char value[256];
+	enum LookupResult result = LOOKUP_NOT_FOUND;
+	struct Trace *trace = current_trace; // set when the lookup runs inline
+	current_trace = &flight->trace;
+
+	struct Upstreams *set = upstreams_get();
+	struct Snapshot *replicated = config.replicate ? snapshot_get() : NULL;
+	if (set && (strchr(flight->key, '@') || set->shard_count)) {
+		char mount[sizeof(flight->mount)] = "";
+		result = upstream_lookup(set, flight->key, value, sizeof(value), mount, sizeof(mount));
+		if (mount[0])
+			mount_note(flight->hash, mount);
+		pthread_mutex_lock(&cache_lock);
+		memcpy(flight->mount, mount, sizeof(mount));
+		pthread_mutex_unlock(&cache_lock);
+	} else if (replicated) {
+		uint64_t started = monotonic_ns();
+		result = snapshot_lookup(replicated, flight->key, value, sizeof(value));
+		trace_stage(STAGE_RESOLVE, started, monotonic_ns());
+	} else if (lookup_home(flight->key, home, sizeof(home))) {
+		char mount[sizeof(flight->mount)];
+		home_mount(home, mount, sizeof(mount));
+		mount_note(flight->hash, mount);
+		pthread_mutex_lock(&cache_lock);
+		memcpy(flight->mount, mount, sizeof(mount));
+		pthread_mutex_unlock(&cache_lock);
+
+		if (breaker_open(mount)) {
+			result = LOOKUP_UNAVAILABLE;
+		} else {
+			result = lookup_file(home, value, sizeof(value));
+			breaker_close(mount);
+		}
+	}
+
+	upstreams_put(set);
+	snapshot_put(replicated);
+
+	current_trace = trace;
+	pthread_mutex_lock(&cache_lock);
+	flight_finish(flight, result, value);
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+/*
+ * the lookup pool
+ * threads are started as lookups are queued, while none is idle, up to lookup_threads, and then kept; the queue is
+ * guarded by cache_lock, like the flights in it
+ */
+#define LOOKUP_QUEUE 256 // lookups waiting for a thread, beyond which requests are answered from the cache
+
+struct Flight *lookup_queue[LOOKUP_QUEUE];
+int lookup_queued = 0;
+int lookup_head = 0;
+int lookup_running = 0; // threads in the pool
+int lookup_idle = 0;    // of which waiting for a lookup
+pthread_cond_t lookup_ready = PTHREAD_COND_INITIALIZER;
+
+void *lookup_thread(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&cache_lock);
+	while (true) {
+		lookup_idle++;
+		while (lookup_queued == 0)
+			pthread_cond_wait(&lookup_ready, &cache_lock);
+		lookup_idle--;
+		struct Flight *flight = lookup_queue[lookup_head];
+		lookup_head = (lookup_head + 1) % LOOKUP_QUEUE;
+		lookup_queued--;
+		pthread_mutex_unlock(&cache_lock);
+		flight_run(flight);
+		pthread_mutex_lock(&cache_lock);
+	}
+	return NULL;
+}
+
+// hand a new flight to the pool; false if the queue is full, or there is no thread to run it; cache_lock must be held
+bool lookup_enqueue(struct Flight *flight) {
+	if (lookup_queued == LOOKUP_QUEUE)
+		return false;
+	if (lookup_idle <= lookup_queued && lookup_running < (config.lookup_threads > 0 ? config.lookup_threads : 1)) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, lookup_thread, NULL) == 0) {
+			pthread_detach(thread);
+			lookup_running++;
+		}
+	}
+	if (lookup_running == 0)
+		return false;
+	lookup_queue[(lookup_head + lookup_queued) % LOOKUP_QUEUE] = flight;
+	lookup_queued++;
+	pthread_cond_signal(&lookup_ready);
+	return true;
+}
+
+/*
+ * look a query up through the in-flight table, caching the result; cache_lock must be held, and is dropped
+ * the reply stays valid until response_release() is called on reply->table; returns false if it is only what the
+ * cache had, as the lookup didn't finish in time or couldn't be made
+ */
+bool lookup_shared(const char *input, uint32_t hash, struct Reply *reply) {
+	struct Flight *flight;
+	for (flight = flights; flight; flight = flight->next) {
+		if (flight->hash == hash && strcmp(flight->key, input) == 0)
+			break;
+	}
+
+	// the lookup is stuck, don't queue up behind it, nor behind lookups stuck on dead mounts
+	if ((flight && flight->timed_out) ||
+	    (!flight && config.lookup_timeout > 0 && (lookup_queued == LOOKUP_QUEUE || mount_skipped(hash)))) {
+		reply_stale(input, hash, reply);
+		return false;
+	}
+
+	bool inline_lookup = false;
+	if (!flight) {
+		flight = calloc(1, sizeof(struct Flight));
+		if (!flight || !(flight->key = strdup(input))) {
+			free(flight);
+			reply_stale(input, hash, reply);
+			return false;
+		}
+		flight->hash = hash;
+		flight->started = monotonic_ns();
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&flight->cond, &attr);
+		pthread_condattr_destroy(&attr);
+		flight->next = flights;
+		flights = flight;
+
+		inline_lookup = config.lookup_timeout <= 0 || !lookup_enqueue(flight);
+	}
+
+	flight->waiters++;
+	if (inline_lookup) {
+		pthread_mutex_unlock(&cache_lock);
+		flight_run(flight);
+		pthread_mutex_lock(&cache_lock);
+	}
+
+	if (config.lookup_timeout > 0) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += config.lookup_timeout / 1000;
+		deadline.tv_nsec += (long)(config.lookup_timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!flight->done) {
+			if (pthread_cond_timedwait(&flight->cond, &cache_lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+	} else {
+		while (!flight->done)
+			pthread_cond_wait(&flight->cond, &cache_lock);
+	}
+	flight->waiters--;
+
+	if (!flight->done) {
+		// serve what we have, and stop sending lookups to the mount that is hanging
+		if (!flight->timed_out && flight->mount[0])
+			breaker_trip(flight->mount);
+		flight->timed_out = true;
+		reply_stale(input, hash, reply);
+		return false;
+	}
+
+	reply->table = flight->table;
+	__atomic_add_fetch(&reply->table->refs, 1, __ATOMIC_RELAXED);
+	reply->response = response_at(reply->table, flight->response);
+	reply->result = flight->result;
+	trace_merge(&flight->trace);
+	bool looked_up = !flight->skipped;
+	if (flight->waiters == 0)
+		flight_free(flight);
+	pthread_mutex_unlock(&cache_lock);
+	return looked_up;
+}
+
+/*
+ * the lock-free read path: look a query up in the published view, and check the seqlock afterwards to know nothing
+ * changed underneath; NULL on a miss, an expired entry, or if writers kept getting in the way
+ * the caller must be between read_begin() and read_end(), which keeps the view and the table alive
+ */
+const struct Response *cache_read(const char *key, uint32_t hash, enum ResultClass *result) {
+	for (int attempt = 0; attempt < 4; attempt++) {
+		uint32_t seq = __atomic_load_n(&cache.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		const struct CacheView *view = __atomic_load_n(&cache_view, __ATOMIC_ACQUIRE);
+		if (!view)
+			return NULL;
+
+		// anything read here may be torn by a writer, so check bounds before following it, and only trust it
+		// once the sequence number is unchanged
+		const struct CacheEntry *entry = NULL;
+		for (uint32_t i = hash & view->index_mask, n = 0; n <= view->index_mask; i = (i + 1) & view->index_mask, n++) {
+			uint32_t e = view->index[i];
+			if (!e || e > view->capacity)
+				break;
+			const struct CacheEntry *candidate = &view->entries[e - 1];
+			if (candidate->hash == hash && candidate->name < view->names_size &&
+			    strcmp(view->names + candidate->name, key) == 0) {
+				entry = candidate;
+				break;
+			}
+		}
+
+		const struct Response *response = NULL;
+		uint32_t stamp = 0;
+		uint32_t value = entry ? entry->value : NO_VALUE;
+		if (value < view->values_capacity) {
+			uint32_t offset = view->values[value].response;
+			if (offset + sizeof(struct Response) <= view->table->size) {
+				response = response_at(view->table, offset);
+				if (offset + sizeof(struct Response) + response->len > view->table->size)
+					response = NULL;
+			}
+			stamp = entry->stamp;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&cache.seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (!response || stamp <= monotonic_seconds())
+			return NULL;
+
+		// popularity, only written until it saturates so hot entries stay read-only; compare-and-swap, so a writer
+		// resetting a counter under the lock isn't undone
+		struct CacheEntry *hot = (struct CacheEntry *)entry;
+		uint8_t freq = __atomic_load_n(&hot->freq, __ATOMIC_RELAXED);
+		while (freq < 3 &&
+		       !__atomic_compare_exchange_n(&hot->freq, &freq, freq + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		uint16_t hits = __atomic_load_n(&hot->hits, __ATOMIC_RELAXED);
+		while (hits < config.refresh_hits &&
+		       !__atomic_compare_exchange_n(&hot->hits, &hits, hits + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		*result = value_result(value);
+		return response;
+	}
+	return NULL;
+}
+
+/*
+ * find the reply for a query; the reply stays valid until response_release() is called on reply->table, or, if that
+ * is NULL, until read_end()
+ */
+void handle_request(const char *input, struct Reply *reply) {
+	uint32_t hash = hash_string(input);
+
+	if (config.cache_ttl > 0 && current_worker) {
+		reply->response = cache_read(input, hash, &reply->result);
+		if (reply->response) {
+			current_worker->hits++;
+			reply->table = NULL;
+			return;
+		}
+		current_worker->misses++;
+	}
+
+	// the slow path holds a reference on the table instead, so waiting on a lookup doesn't hold up reclamation
+	read_end();
+	uint64_t started = monotonic_ns();
+	pthread_mutex_lock(&cache_lock);
+	if (config.cache_ttl > 0 && !current_worker)
+		cache.misses++;
+	lookup_shared(input, hash, reply);
+	trace_stage(STAGE_LOOKUP, started, monotonic_ns());
+}
+
+/*
+ * refresh-ahead
+ * entries that were asked for at least refresh_hits times are looked up again in the background during the last
+ * refresh_ahead seconds before they expire, while the current reply keeps being served, so popular users never
+ * pay for a miss
+ */
+#define REFRESH_BATCH 64 // most entries refreshed per pass, the rest wait for the next second
+
+void *refresher(void *arg) {
+	(void)arg;
+	while (true) {
+		sleep(1);
+		reclaim();
+
+		char *keys[REFRESH_BATCH];
+		uint32_t hashes[REFRESH_BATCH];
+		int count = 0;
+
+		pthread_mutex_lock(&cache_lock);
+		uint32_t now = (uint32_t)monotonic_seconds();
+		if (config.cache_ttl > 0 && config.refresh_ahead > 0) {
+			for (uint32_t i = 0; i < cache.capacity && count < REFRESH_BATCH; i++) {
+				struct CacheEntry *entry = &cache.entries[i];
+				if (entry->queue == QUEUE_FREE || entry->stamp <= now || entry->stamp - now > (uint32_t)config.refresh_ahead)
+					continue;
+				if (__atomic_load_n(&entry->hits, __ATOMIC_RELAXED) < config.refresh_hits)
+					continue;
+				keys[count] = strdup(entry_name(entry));
+				if (!keys[count])
+					break;
+				hashes[count++] = entry->hash;
+				__atomic_store_n(&entry->hits, 0, __ATOMIC_RELAXED); // the refreshed entry has to earn its next refresh
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+
+		for (int i = 0; i < count; i++) {
+			struct Reply reply;
+			pthread_mutex_lock(&cache_lock);
+			lookup_shared(keys[i], hashes[i], &reply);
+			response_release(reply.table);
+			free(keys[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * access log
+ * workers append a fixed-size record per request to a ring of their own, without locks or syscalls, and a background
+ * thread drains the rings every ACCESS_LOG_INTERVAL_MS and writes them out in batches; when a ring is full the record
+ * is dropped and counted rather than making the worker wait
+ * a log file that can't be opened is reported once, and retried with a backoff, from ACCESS_LOG_RETRY_MS doubling up to
+ * ACCESS_LOG_RETRY_MAX_MS; it is reported again once it has been opened since, or on SIGHUP
+ */
+struct AccessRecord {
+	struct timespec time; // wall clock, when the request was accepted
+	uint32_t latency_us;
+	uint8_t result;
+	uint8_t family;
+	uint16_t port;
+	uint8_t addr[16];
+	char query[64];
+};
+
+#define ACCESS_RING_SIZE 1024 // records per worker, must be a power of two
+#define ACCESS_LOG_INTERVAL_MS 100
+#define ACCESS_LOG_RETRY_MS 1000
+#define ACCESS_LOG_RETRY_MAX_MS 60000
+
+struct AccessRing {
+	uint32_t head __attribute__((aligned(64))); // only written by the worker
+	uint64_t dropped;
+	uint32_t tail __attribute__((aligned(64))); // only written by the log thread
+	struct AccessRecord records[ACCESS_RING_SIZE];
+};
+
+bool access_log_reopen = false; // set on SIGHUP, so the log can be rotated
+
+void access_log_record(const struct sockaddr_storage *peer, const char *query, enum ResultClass result,
+                       const struct timespec *accepted, uint32_t latency_us) {
+	struct AccessRing *ring = current_worker->log;
+	uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ACCESS_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct AccessRecord *record = &ring->records[head & (ACCESS_RING_SIZE - 1)];
+	record->time = *accepted;
+	record->latency_us = latency_us;
+	record->result = result;
+	record->family = peer->ss_family;
+	if (peer->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)peer;
+		memcpy(record->addr, &in6->sin6_addr, 16);
+		record->port = ntohs(in6->sin6_port);
+	} else if (peer->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+		memcpy(record->addr, &in->sin_addr, 4);
+		record->port = ntohs(in->sin_port);
+	}
+	strncpy(record->query, query, sizeof(record->query) - 1);
+	record->query[sizeof(record->query) - 1] = '\0';
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// one logfmt line per record; the query comes from the network, so anything unprintable is escaped
+size_t access_log_format(const struct AccessRecord *record, char *line, size_t size) {
+	struct tm tm;
+	gmtime_r(&record->time.tv_sec, &tm);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	char addr[INET6_ADDRSTRLEN] = "-";
+	if (record->family == AF_INET6 || record->family == AF_INET)
+		inet_ntop(record->family, record->addr, addr, sizeof(addr));
+
+	char query[4 * sizeof(record->query)];
+	size_t q = 0;
+	for (const char *c = record->query; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			q += sprintf(query + q, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20 || (unsigned char)*c >= 0x7f)
+			q += sprintf(query + q, "\\x%02x", (unsigned char)*c);
+		else
+			query[q++] = *c;
+	}
+	query[q] = '\0';
+
+	int len = snprintf(line, size, "%s.%06ldZ peer=%s%s%s:%u query=\"%s\" result=%s latency_us=%u\n", stamp,
+	                   record->time.tv_nsec / 1000, record->family == AF_INET6 ? "[" : "", addr,
+	                   record->family == AF_INET6 ? "]" : "", record->port, query, result_names[record->result],
+	                   record->latency_us);
+	return len < 0 ? 0 : (size_t)len >= size ? size - 1 : (size_t)len;
+}
+
+void *access_logger(void *arg) {
+	(void)arg;
+	int fd = -1;
+	uint64_t reported_drops = 0;
+	char batch[64 << 10];
+	size_t used = 0;
+	bool failing = false; // the last open failed, and has been reported
+	uint64_t retry_at = 0;
+	int backoff = ACCESS_LOG_RETRY_MS;
+
+	while (true) {
+		struct timespec interval = {0, ACCESS_LOG_INTERVAL_MS * 1000000L};
+		nanosleep(&interval, NULL);
+
+		const char *path = config.access_log;
+		bool to_syslog = path && strcmp(path, "syslog") == 0;
+		bool reopen = __atomic_exchange_n(&access_log_reopen, false, __ATOMIC_ACQ_REL);
+		if (fd >= 0 && (!path || to_syslog || reopen)) {
+			close(fd);
+			fd = -1;
+		}
+		if (reopen) {
+			failing = false;
+			retry_at = 0;
+			backoff = ACCESS_LOG_RETRY_MS;
+		}
+		uint64_t now = monotonic_ns();
+		if (path && !to_syslog && fd < 0 && now >= retry_at) {
+			fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+			if (fd >= 0) {
+				failing = false;
+				backoff = ACCESS_LOG_RETRY_MS;
+			} else {
+				if (!failing)
+					error("could not open access log %s", path);
+				failing = true;
+				retry_at = now + (uint64_t)backoff * 1000000;
+				backoff = backoff * 2 < ACCESS_LOG_RETRY_MAX_MS ? backoff * 2 : ACCESS_LOG_RETRY_MAX_MS;
+			}
+		}
+
+		uint64_t drops = 0;
+		for (int i = 0; i < worker_count; i++) {
+			struct AccessRing *ring = workers[i].log;
+			uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			for (uint32_t tail = ring->tail; tail != head; tail++) {
+				char line[512];
+				size_t len = access_log_format(&ring->records[tail & (ACCESS_RING_SIZE - 1)], line, sizeof(line));
+				if (to_syslog) {
+					syslog(LOG_INFO, "%.*s", (int)len - 1, line);
+				} else if (fd >= 0) {
+					if (used + len > sizeof(batch)) {
+						write(fd, batch, used);
+						used = 0;
+					}
+					memcpy(batch + used, line, len);
+					used += len;
+				}
+			}
+			__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+			drops += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		}
+
+		if (drops > reported_drops) {
+			char line[128];
+			int len = snprintf(line, sizeof(line), "access log dropped %llu records, %llu in total\n",
+			                   (unsigned long long)(drops - reported_drops), (unsigned long long)drops);
+			if (to_syslog) {
+				syslog(LOG_WARNING, "%.*s", len - 1, line);
+			} else if (fd >= 0 && used + len <= sizeof(batch)) {
+				memcpy(batch + used, line, len);
+				used += len;
+			}
+			reported_drops = drops;
+		}
+
+		if (fd >= 0 && used > 0)
+			write(fd, batch, used);
+		used = 0;
+	}
+	return NULL;
+}
+
+/*
+ * metrics
+ * every worker keeps its own counters and latency histograms, written without atomics or locks and only summed when
+ * the metrics listener is scraped, which serves them in the Prometheus text format over HTTP
+ */
+int metrics_sockfd = -1;
+
+void histogram_print(FILE *out, const char *stage, const uint64_t *buckets, uint64_t sum) {
+	uint64_t count = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		count += buckets[i];
+		if (i == HIST_BUCKETS - 1)
+			fprintf(out, "pronound_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage,
+			        (unsigned long long)count);
+		else
+			fprintf(out, "pronound_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage,
+			        histogram_upper(i) / 1e6, (unsigned long long)count);
+	}
+	fprintf(out, "pronound_stage_seconds_sum{stage=\"%s\"} %g\n", stage, sum / 1e6);
+	fprintf(out, "pronound_stage_seconds_count{stage=\"%s\"} %llu\n", stage, (unsigned long long)count);
+}
+
+void metrics_print(FILE *out) {
+	uint64_t results[RESULT_CLASSES] = {0};
+	uint64_t hits = 0, misses = 0, slow = 0;
+	int active = 0;
+	uint64_t buckets[STAGES][HIST_BUCKETS];
+	uint64_t sums[STAGES] = {0};
+	memset(buckets, 0, sizeof(buckets));
+
+	for (int i = 0; i < worker_count; i++) {
+		struct Metrics *metrics = workers[i].metrics;
+		for (int r = 0; r < RESULT_CLASSES; r++)
+			results[r] += __atomic_load_n(&metrics->results[r], __ATOMIC_RELAXED);
+		for (int s = 0; s < STAGES; s++) {
+			for (int b = 0; b < HIST_BUCKETS; b++)
+				buckets[s][b] += __atomic_load_n(&metrics->latency[s][b], __ATOMIC_RELAXED);
+			sums[s] += __atomic_load_n(&metrics->latency_sum[s], __ATOMIC_RELAXED);
+		}
+		active += __atomic_load_n(&metrics->active, __ATOMIC_RELAXED);
+		slow += __atomic_load_n(&metrics->slow, __ATOMIC_RELAXED);
+		hits += __atomic_load_n(&workers[i].hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&workers[i].misses, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	uint32_t entries = cache.small.count + cache.main.count;
+	size_t bytes = (size_t)entries * sizeof(struct CacheEntry) + cache.names_live + cache.value_bytes;
+	size_t budget = cache.budget;
+	uint64_t evictions = cache.evictions;
+	hits += cache.hits;
+	misses += cache.misses;
+	int in_flight = 0;
+	for (struct Flight *flight = flights; flight; flight = flight->next)
+		in_flight++;
+	pthread_mutex_unlock(&cache_lock);
+
+	fprintf(out, "# HELP pronound_requests_total Requests answered, by result.\n");
+	fprintf(out, "# TYPE pronound_requests_total counter\n");
+	for (int r = 0; r < RESULT_CLASSES; r++)
+		fprintf(out, "pronound_requests_total{result=\"%s\"} %llu\n", result_names[r], (unsigned long long)results[r]);
+
+	fprintf(out, "# HELP pronound_cache_hits_total Queries answered from the cache.\n");
+	fprintf(out, "# TYPE pronound_cache_hits_total counter\n");
+	fprintf(out, "pronound_cache_hits_total %llu\n", (unsigned long long)hits);
+	fprintf(out, "# HELP pronound_cache_misses_total Queries that needed a lookup.\n");
+	fprintf(out, "# TYPE pronound_cache_misses_total counter\n");
+	fprintf(out, "pronound_cache_misses_total %llu\n", (unsigned long long)misses);
+	fprintf(out, "# HELP pronound_cache_evictions_total Entries evicted to stay within cache_bytes.\n");
+	fprintf(out, "# TYPE pronound_cache_evictions_total counter\n");
+	fprintf(out, "pronound_cache_evictions_total %llu\n", (unsigned long long)evictions);
+	fprintf(out, "# HELP pronound_cache_entries Entries in the cache.\n");
+	fprintf(out, "# TYPE pronound_cache_entries gauge\n");
+	fprintf(out, "pronound_cache_entries %u\n", entries);
+	fprintf(out, "# HELP pronound_cache_bytes Bytes used by cached entries, out of pronound_cache_budget_bytes.\n");
+	fprintf(out, "# TYPE pronound_cache_bytes gauge\n");
+	fprintf(out, "pronound_cache_bytes %zu\n", bytes);
+	fprintf(out, "# TYPE pronound_cache_budget_bytes gauge\n");
+	fprintf(out, "pronound_cache_budget_bytes %zu\n", budget);
+
+	fprintf(out, "# HELP pronound_active_connections Connections being answered.\n");
+	fprintf(out, "# TYPE pronound_active_connections gauge\n");
+	fprintf(out, "pronound_active_connections %d\n", active);
+	fprintf(out, "# HELP pronound_idle_connections Connections waiting on their client to send more.\n");
+	fprintf(out, "# TYPE pronound_idle_connections gauge\n");
+	fprintf(out, "pronound_idle_connections %d\n", __atomic_load_n(&parked_count, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP pronound_lookups_in_flight Lookups running or waited on.\n");
+	fprintf(out, "# TYPE pronound_lookups_in_flight gauge\n");
+	fprintf(out, "pronound_lookups_in_flight %d\n", in_flight);
+
+	struct tcp_info info;
+	socklen_t info_len = sizeof(info);
+	if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+		// for a listening socket, the kernel reports the accept queue in these
+		fprintf(out, "# HELP pronound_accept_queue_depth Connections waiting to be accepted.\n");
+		fprintf(out, "# TYPE pronound_accept_queue_depth gauge\n");
+		fprintf(out, "pronound_accept_queue_depth %u\n", info.tcpi_unacked);
+	}
+
+	fprintf(out, "# HELP pronound_slow_requests_total Requests slower than trace_slow.\n");
+	fprintf(out, "# TYPE pronound_slow_requests_total counter\n");
+	fprintf(out, "pronound_slow_requests_total %llu\n", (unsigned long long)slow);
+	fprintf(out, "# HELP pronound_stage_seconds Time spent in each stage of a request.\n");
+	fprintf(out, "# TYPE pronound_stage_seconds histogram\n");
+	for (int s = 0; s < STAGES; s++)
+		histogram_print(out, stage_names[s], buckets[s], sums[s]);
+}
+
+// answer one scrape; whatever the request, the reply is the metrics
+void metrics_serve(int client_sock) {
+	char request[1024];
+	struct timeval timeout = {1, 0};
+	setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (read(client_sock, request, sizeof(request)) < 0)
+		return;
+
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *out = open_memstream(&body, &body_len);
+	if (!out)
+		return;
+	metrics_print(out);
+	fclose(out);
+
+	char header[128];
+	int header_len = snprintf(header, sizeof(header),
+	                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+	                          body_len);
+	struct iovec iov[2] = {{header, header_len}, {body, body_len}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+	sendmsg(client_sock, &msg, MSG_NOSIGNAL);
+	free(body);
+}
+
+void *metrics_listener(void *arg) {
+	(void)arg;
+	while (true) {
+		int client_sock = accept(metrics_sockfd, NULL, NULL);
+		if (client_sock < 0)
+			continue;
+		metrics_serve(client_sock);
+		close(client_sock);
+	}
+	return NULL;
+}
+
+// a listening unix socket at path, replacing whatever was left there; -1 on failure
+int listen_unix(const char *path, mode_t mode) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path, mode) < 0 ||
+	    listen(fd, 16) < 0) {
+		error("socket %s failed", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// a listener for what (metrics, snapshots) on a port, or on a unix socket if the setting is a path; -1 on failure
+int listen_at(const char *where, const char *what, mode_t mode) {
+	if (where[0] == '/')
+		return listen_unix(where, mode);
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, where, &hints, &res) != 0) {
+		error("%s getaddrinfo failed", what);
+		return -1;
+	}
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	int yes = 1;
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0 ||
+	    bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+		error("%s bind failed", what);
+		if (fd >= 0)
+			close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/*
+ * admin socket
+ * a unix socket, only usable by root, taking one command per connection:
+ * stats - the same statistics SIGUSR1 logs
+ */
+int admin_sockfd = -1;
+
+void admin_serve(int client_sock) {
+	char command[64];
+	struct timeval timeout = {1, 0};
+	setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	ssize_t len = read(client_sock, command, sizeof(command) - 1);
+	if (len < 0)
+		return;
+	command[len] = '\0';
+
+	FILE *out = fdopen(dup(client_sock), "w");
+	if (!out)
+		return;
+	if (strcmp(strip_in_place(command), "stats") == 0)
+		stats_print(out);
+	else
+		fprintf(out, "unknown command, try stats\n");
+	fclose(out);
+}
+
+void *admin_listener(void *arg) {
+	(void)arg;
+	while (true) {
+		int client_sock = accept(admin_sockfd, NULL, NULL);
+		if (client_sock < 0)
+			continue;
+		admin_serve(client_sock);
+		close(client_sock);
+	}
+	return NULL;
+}
+
+bool drop_privileges(const char *user) {
+	struct passwd *pw = getpwnam(user);
+	if (!pw) {
+		fprintf(stderr, "User %s not found\n", user);
+		return false;
+	}
+
+	if (setgid(pw->pw_gid) != 0) {
+		perror("setgid");
+		return false;
+	}
+
+	if (setuid(pw->pw_uid) != 0) {
+		perror("setuid");
+		return false;
+	}
+
+	return true;
+}
+
+bool parse_config(const char *filename) {
+	/*
+	 * config file format:
+	 * daemonise <true|false>
+	 * default_pronouns <pronouns>
+	 * file_path <path>
+	 * port <port>
+	 * daemon_user <user>
+	 * cache_ttl <seconds>
+	 * workers <count>
+	 * refresh_ahead <seconds>
+	 * refresh_hits <count>
+	 * lookup_timeout <milliseconds>
+	 * lookup_threads <count>
+	 * breaker_cooldown <seconds>
+	 * cache_bytes <bytes>
+	 * access_log <path|syslog>
+	 * metrics <port|path>
+	 * trace_slow <milliseconds>
+	 * trace_sample <count>
+	 * admin_socket <path>
+	 * passwd_file <path>
+	 * keepalive <milliseconds>
+	 * udp <true|false>
+	 * upstream <host> <address>[:<port>]
+	 * shard <address>[:<port>] [<replica address>[:<port>]...]
+	 * upstream_connections <count>
+	 * health_interval <seconds>
+	 * snapshot_serve <port|path>
+	 * replicate <address>:<port>
+	 * snapshot_file <path>
+	 * snapshot_interval <seconds>
+	 * watch_interval <seconds>
+	 */
+	struct Upstreams *parsed = NULL;
+
+	FILE *file = fopen(filename, "r");
+	if (!file) {
+		perror("Could not open config file");
+		return false;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		char *key, *value;
+		char *cleaned_line = strip(line);
+		if (strlen(cleaned_line) == 0 || cleaned_line[0] == '#') {
+			free(cleaned_line);
+			continue; // skip empty lines and comments
+		}
+		if (!split_first_space(cleaned_line, &key, &value)) {
+			free(cleaned_line);
+			upstreams_free(parsed);
+			fclose(file);
+			return false; // error splitting line
+		}
+
+		if (strcmp(key, "daemonise") == 0) {
+			config.daemonise = (value && (strcmp(value, "true") == 0 || strcmp(value, "1") == 0));
+		} else if (strcmp(key, "defaults") == 0) {
+			// ensure terminated in newline
+			char *newline = malloc(strlen(value) + 2);
+			if (!newline) {
+				free(key);
+				free(value);
+				free(cleaned_line);
+				upstreams_free(parsed);
+				fclose(file);
+				return false;
+			}
+			strcpy(newline, value);
+			newline[strlen(value)] = '\n';
+			newline[strlen(value) + 1] = '\0';
+			config.default_pronouns = newline;
+		} else if (strcmp(key, "file") == 0) {
+			config.file_path = strdup(value);
+		} else if (strcmp(key, "port") == 0) {
+			config.port = atoi(value);
+		} else if (strcmp(key, "user") == 0) {
+			config.daemon_user = strdup(value);
+		} else if (strcmp(key, "cache_ttl") == 0) {
+			config.cache_ttl = atoi(value);
+		} else if (strcmp(key, "workers") == 0) {
+			config.workers = atoi(value);
+		} else if (strcmp(key, "refresh_ahead") == 0) {
+			config.refresh_ahead = atoi(value);
+		} else if (strcmp(key, "refresh_hits") == 0) {
+			config.refresh_hits = atoi(value);
+		} else if (strcmp(key, "lookup_timeout") == 0) {
+			config.lookup_timeout = atoi(value);
+		} else if (strcmp(key, "lookup_threads") == 0) {
+			config.lookup_threads = atoi(value);
+		} else if (strcmp(key, "breaker_cooldown") == 0) {
+			config.breaker_cooldown = atoi(value);
+		} else if (strcmp(key, "cache_bytes") == 0) {
+			config.cache_bytes = atoi(value);
+		} else if (strcmp(key, "access_log") == 0) {
+			config.access_log = strdup(value);
+		} else if (strcmp(key, "metrics") == 0) {
+			config.metrics = strdup(value);
+		} else if (strcmp(key, "trace_slow") == 0) {
+			config.trace_slow = atoi(value);
+		} else if (strcmp(key, "trace_sample") == 0) {
+			config.trace_sample = atoi(value);
+		} else if (strcmp(key, "admin_socket") == 0) {
+			config.admin_socket = strdup(value);
+		} else if (strcmp(key, "passwd_file") == 0) {
+			config.passwd_file = strdup(value);
+		} else if (strcmp(key, "keepalive") == 0) {
+			config.keepalive = atoi(value);
+		} else if (strcmp(key, "udp") == 0) {
+			config.udp = (value && (strcmp(value, "true") == 0 || strcmp(value, "1") == 0));
+		} else if (strcmp(key, "upstream") == 0) {
+			if (!upstream_parse(&parsed, value)) {
+				upstreams_free(parsed);
+				fclose(file);
+				return false;
+			}
+		} else if (strcmp(key, "shard") == 0) {
+			if (!shard_parse(&parsed, value)) {
+				upstreams_free(parsed);
+				fclose(file);
+				return false;
+			}
+		} else if (strcmp(key, "upstream_connections") == 0) {
+			config.upstream_limit = atoi(value);
+		} else if (strcmp(key, "health_interval") == 0) {
+			config.health_interval = atoi(value);
+		} else if (strcmp(key, "snapshot_serve") == 0) {
+			config.snapshot_serve = strdup(value);
+		} else if (strcmp(key, "replicate") == 0) {
+			char *address = strdup(value), *host, *port;
+			bool has_port = address && address_split(address, &host, &port);
+			free(address);
+			if (!has_port) {
+				fprintf(stderr, "replicate needs an address and a port\n");
+				free(key);
+				free(value);
+				free(cleaned_line);
+				upstreams_free(parsed);
+				fclose(file);
+				return false;
+			}
+			config.replicate = strdup(value);
+		} else if (strcmp(key, "snapshot_file") == 0) {
+			config.snapshot_file = strdup(value);
+		} else if (strcmp(key, "snapshot_interval") == 0) {
+			config.snapshot_interval = atoi(value);
+		} else if (strcmp(key, "watch_interval") == 0) {
+			config.watch_interval = atoi(value);
+		}
+	}
+	fclose(file);
+	upstreams_swap(parsed);
+	return true;
+}
+
+void daemonise() {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid > 0) {
+		exit(0); // parent exits
+	}
+
+	if (setsid() < 0) {
+		perror("setsid");
+		exit(1);
+	}
+
+	umask(0); // clear file mode creation mask
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+
+	open("/dev/null", O_RDONLY);
+	open("/dev/null", O_WRONLY);
+}
+
+void handle_signal(int sig) {
+	if (sig == SIGINT || sig == SIGTERM) {
+		close(sockfd);
+		exit(0);
+	}
+	if (sig == SIGHUP) {
+		// Reload configuration if needed
+		if (!parse_config(config_path)) {
+			fprintf(stderr, "Failed to reload config file\n");
+		}
+		if (config.passwd_file && !fixture_load(config.passwd_file)) {
+			fprintf(stderr, "Failed to reload passwd file\n");
+		}
+		if (!responses_init()) {
+			fprintf(stderr, "Failed to rebuild response table\n");
+		}
+		if (!health_start()) {
+			fprintf(stderr, "Failed to start health checker\n");
+		}
+		__atomic_store_n(&access_log_reopen, true, __ATOMIC_RELEASE);
+
+		// forking now would leave the workers behind, so daemonising only happens at startup
+		if (config.daemonise && !daemonised) {
+			fprintf(stderr, "daemonise takes effect on restart\n");
+		}
+	}
+	if (sig == SIGUSR1) {
+		stats_log();
+	}
+}
+
+/*
+ * watching
+ * a client sending WATCH and a list of users gets a line for each, "<user>: <reply>", then the connection is kept open
+ * and a line pushed whenever the reply for one of them changes; watching connections are handed over to a thread of
+ * their own, which keeps a record per watched user with its subscribers, so a change costs one lookup however many
+ * clients are watching
+ * a local pronouns file changing is noticed through inotify on its directory, and every watched user is looked up again
+ * every watch_interval seconds, for homes on NFS, upstreams and snapshots, which inotify can't see; the lines from a
+ * pass are gathered per client and written together, and a client that stops reading them is dropped
+ * the lookups themselves are made by WATCH_THREADS threads of their own, which post each reply back to the watcher,
+ * so a mount that hangs holds up only the users on it; a reply that is only what the cache had, as the lookup timed
+ * out or the mount is being skipped, isn't pushed
+ */
+#define WATCH_BUCKETS 1024
+#define WATCH_USERS 256    // most users one connection may watch
+#define WATCH_BUFFER 65536 // most output waiting for a client before it is dropped
+#define WATCH_THREADS 4    // looking watched users up again
+
+struct Watcher;
+
+struct Watched {
+	struct Watched *next;    // in its bucket
+	struct Watched *wd_next; // in its bucket of watched_by_wd
+	char *user;
+	uint32_t hash;
+	char *reply; // the last one pushed, newline included
+	int wd;      // inotify watch on the directory holding the user's pronouns file, -1 for none
+	bool revalidating; // a lookup is on its way
+	bool again;        // and another is wanted once it is back, as the file changed meanwhile
+	struct Watcher **subscribers;
+	int count;
+	int size;
+};
+
+struct Watcher {
+	int fd;
+	int index; // in watchers
+	struct Watched *watching[WATCH_USERS];
+	int count;
+	char *out; // lines not yet written
+	size_t out_len;
+	bool dead; // closed, freed at the end of the pass
+};
+
+// a connection on its way from a worker to the watcher, with the replies it was sent
+struct WatchStart {
+	struct WatchStart *next;
+	int fd;
+	int count;
+	char *users[WATCH_USERS];
+	char *replies[WATCH_USERS];
+};
+
+// a watched user to look up again, on its way to a lookup thread and then back with the reply
+struct Revalidation {
+	struct Revalidation *next;
+	char *user;
+	uint32_t hash;
+	char *reply; // NULL if the lookup didn't give one to push
+};
+
+struct WatchStart *watch_pending = NULL;
+struct Revalidation *revalidate_head = NULL, *revalidate_tail = NULL; // waiting for a lookup thread
+struct Revalidation *revalidated = NULL;                              // waiting for the watcher
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t revalidate_ready = PTHREAD_COND_INITIALIZER;
+int watch_eventfd = -1;
+
+// owned by the watcher thread
+struct Watched *watched_users[WATCH_BUCKETS];
+struct Watched *watched_by_wd[WATCH_BUCKETS];
+struct Watcher **watchers = NULL;
+int watcher_count = 0;
+int watcher_size = 0;
+int watch_epfd = -1;
+int watch_inotify = -1;
+
+void watch_start_free(struct WatchStart *start) {
+	for (int i = 0; i < start->count; i++) {
+		free(start->users[i]);
+		free(start->replies[i]);
+	}
+	free(start);
+}
+
+bool watch_request(const char *query) {
+	return strncmp(query, "WATCH", 5) == 0 && (query[5] == ' ' || query[5] == '\t');
+}
+
+/*
+ * answer a WATCH request from a worker, and hand the connection over to the watcher thread; false if it couldn't be,
+ * and the connection should be closed
+ */
+bool watch_start(int client_sock, char *request) {
+	struct WatchStart *start = calloc(1, sizeof(struct WatchStart));
+	char *lines = NULL;
+	size_t lines_len = 0;
+	FILE *out = open_memstream(&lines, &lines_len);
+	if (!start || !out) {
+		free(start);
+		if (out)
+			fclose(out);
+		return false;
+	}
+	start->fd = client_sock;
+
+	// these lookups aren't requests of their own, so aren't traced
+	struct Trace *trace = current_trace;
+	current_trace = NULL;
+	char *save;
+	for (char *user = strtok_r(request + 5, " \t", &save); user && start->count < WATCH_USERS;
+	     user = strtok_r(NULL, " \t", &save)) {
+		struct Reply reply;
+		read_begin();
+		handle_request(user, &reply);
+		int i = start->count;
+		start->users[i] = strdup(user);
+		start->replies[i] = strndup(reply.response->data, reply.response->len);
+		if (reply.table)
+			response_release(reply.table);
+		read_end();
+		start->count++;
+		if (!start->users[i] || !start->replies[i])
+			break;
+		fprintf(out, "%s: %s", start->users[i], start->replies[i]);
+	}
+	current_trace = trace;
+	fclose(out);
+
+	bool sent = start->count > 0 && send(client_sock, lines, lines_len, MSG_NOSIGNAL) == (ssize_t)lines_len;
+	free(lines);
+	if (!sent || watch_eventfd < 0) {
+		watch_start_free(start);
+		return false;
+	}
+	pthread_mutex_lock(&watch_lock);
+	start->next = watch_pending;
+	watch_pending = start;
+	pthread_mutex_unlock(&watch_lock);
+	uint64_t one = 1;
+	if (write(watch_eventfd, &one, sizeof(one)) < 0) {
+		// the watcher wakes on its next pass anyway
+	}
+	return true;
+}
+
+// queue a line for a client, dropping it if it has fallen too far behind
+void watcher_queue(struct Watcher *watcher, const char *user, const char *reply) {
+	size_t user_len = strlen(user), reply_len = strlen(reply);
+	size_t len = watcher->out_len + user_len + 2 + reply_len;
+	char *out = len <= WATCH_BUFFER ? realloc(watcher->out, len) : NULL;
+	if (!out) {
+		watcher->dead = true;
+		return;
+	}
+	memcpy(out + watcher->out_len, user, user_len);
+	memcpy(out + watcher->out_len + user_len, ": ", 2);
+	memcpy(out + watcher->out_len + user_len + 2, reply, reply_len);
+	watcher->out = out;
+	watcher->out_len = len;
+}
+
+// write what is queued for a client, waiting for it to be writable again if it couldn't all go
+void watcher_flush(struct Watcher *watcher) {
+	if (watcher->dead || !watcher->out_len)
+		return;
+	ssize_t sent = send(watcher->fd, watcher->out, watcher->out_len, MSG_NOSIGNAL);
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		watcher->dead = true;
+		return;
+	}
+	if (sent > 0) {
+		memmove(watcher->out, watcher->out + sent, watcher->out_len - sent);
+		watcher->out_len -= sent;
+	}
+	struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | (watcher->out_len ? EPOLLOUT : 0),
+	                            .data.ptr = watcher};
+	epoll_ctl(watch_epfd, EPOLL_CTL_MOD, watcher->fd, &event);
+}
+
+struct Watched *watched_find(const char *user, uint32_t hash) {
+	for (struct Watched *watched = watched_users[hash % WATCH_BUCKETS]; watched; watched = watched->next) {
+		if (watched->hash == hash && strcmp(watched->user, user) == 0)
+			return watched;
+	}
+	return NULL;
+}
+
+// push a user's reply to their subscribers, if it has changed
+void watched_set(struct Watched *watched, const char *reply, size_t len) {
+	if (strlen(watched->reply) == len && memcmp(watched->reply, reply, len) == 0)
+		return;
+	char *copy = strndup(reply, len);
+	if (!copy)
+		return;
+	free(watched->reply);
+	watched->reply = copy;
+	for (int i = 0; i < watched->count; i++)
+		watcher_queue(watched->subscribers[i], watched->user, watched->reply);
+}
+
+void revalidation_free(struct Revalidation *revalidation) {
+	free(revalidation->user);
+	free(revalidation->reply);
+	free(revalidation);
+}
+
+// have a watched user looked up again, bypassing the cache, and refreshing it for everyone else
+void watched_revalidate(struct Watched *watched) {
+	if (watched->revalidating) {
+		watched->again = true;
+		return;
+	}
+	struct Revalidation *revalidation = calloc(1, sizeof(struct Revalidation));
+	if (!revalidation || !(revalidation->user = strdup(watched->user))) {
+		free(revalidation);
+		return; // the next pass tries again
+	}
+	revalidation->hash = watched->hash;
+	watched->revalidating = true;
+	pthread_mutex_lock(&watch_lock);
+	if (revalidate_tail)
+		revalidate_tail->next = revalidation;
+	else
+		revalidate_head = revalidation;
+	revalidate_tail = revalidation;
+	pthread_cond_signal(&revalidate_ready);
+	pthread_mutex_unlock(&watch_lock);
+}
+
+// a lookup is back; push the reply if the user is still watched
+void watched_revalidated(struct Revalidation *revalidation) {
+	struct Watched *watched = watched_find(revalidation->user, revalidation->hash);
+	if (watched) {
+		watched->revalidating = false;
+		if (revalidation->reply)
+			watched_set(watched, revalidation->reply, strlen(revalidation->reply));
+		if (watched->again) {
+			watched->again = false;
+			watched_revalidate(watched);
+		}
+	}
+	revalidation_free(revalidation);
+}
+
+void *watch_lookup_thread(void *arg) {
+	(void)arg;
+	while (true) {
+		pthread_mutex_lock(&watch_lock);
+		while (!revalidate_head)
+			pthread_cond_wait(&revalidate_ready, &watch_lock);
+		struct Revalidation *revalidation = revalidate_head;
+		revalidate_head = revalidation->next;
+		if (!revalidate_head)
+			revalidate_tail = NULL;
+		pthread_mutex_unlock(&watch_lock);
+
+		struct Reply reply;
+		pthread_mutex_lock(&cache_lock);
+		if (lookup_shared(revalidation->user, revalidation->hash, &reply) && reply.result != RESULT_STALE)
+			revalidation->reply = strndup(reply.response->data, reply.response->len);
+		response_release(reply.table);
+
+		pthread_mutex_lock(&watch_lock);
+		revalidation->next = revalidated;
+		revalidated = revalidation;
+		pthread_mutex_unlock(&watch_lock);
+		uint64_t one = 1;
+		if (write(watch_eventfd, &one, sizeof(one)) < 0) {
+			// the watcher picks it up on its next wake anyway
+		}
+	}
+	return NULL;
+}
+
+// watch the directory holding a local user's pronouns file; upstream users and homes we can't read are left to polling
+void watched_notify(struct Watched *watched) {
+	char home[256], path[512];
+	watched->wd = -1;
+	if (strchr(watched->user, '@') || config.replicate || !lookup_home(watched->user, home, sizeof(home)))
+		return;
+	snprintf(path, sizeof(path), "%s/%s", home, config.file_path);
+	*strrchr(path, '/') = '\0';
+	watched->wd = inotify_add_watch(watch_inotify, path,
+	                                IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+	if (watched->wd >= 0) {
+		watched->wd_next = watched_by_wd[watched->wd % WATCH_BUCKETS];
+		watched_by_wd[watched->wd % WATCH_BUCKETS] = watched;
+	}
+}
+
+// a watched user a connection asked for, and the reply it was sent
+bool watcher_subscribe(struct Watcher *watcher, const char *user, const char *sent) {
+	uint32_t hash = hash_string(user);
+	struct Watched *watched = watched_find(user, hash);
+	if (!watched) {
+		watched = calloc(1, sizeof(struct Watched));
+		if (!watched || !(watched->user = strdup(user)) || !(watched->reply = strdup(sent))) {
+			if (watched)
+				free(watched->user);
+			free(watched);
+			return false;
+		}
+		watched->hash = hash;
+		watched_notify(watched);
+		watched->next = watched_users[hash % WATCH_BUCKETS];
+		watched_users[hash % WATCH_BUCKETS] = watched;
+	}
+	for (int i = 0; i < watcher->count; i++) {
+		if (watcher->watching[i] == watched)
+			return true; // asked for twice
+	}
+	if (watched->count == watched->size) {
+		int size = watched->size ? watched->size * 2 : 4;
+		struct Watcher **grown = realloc(watched->subscribers, size * sizeof(struct Watcher *));
+		if (!grown)
+			return false;
+		watched->subscribers = grown;
+		watched->size = size;
+	}
+	watched->subscribers[watched->count++] = watcher;
+	watcher->watching[watcher->count++] = watched;
+	// it changed between the worker's lookup and now
+	if (strcmp(watched->reply, sent) != 0)
+		watcher_queue(watcher, user, watched->reply);
+	return true;
+}
+
+void watched_unsubscribe(struct Watched *watched, struct Watcher *watcher) {
+	for (int i = 0; i < watched->count; i++) {
+		if (watched->subscribers[i] == watcher) {
+			watched->subscribers[i] = watched->subscribers[--watched->count];
+			break;
+		}
+	}
+	if (watched->count > 0)
+		return;
+
+	struct Watched **link = &watched_users[watched->hash % WATCH_BUCKETS];
+	while (*link != watched)
+		link = &(*link)->next;
+	*link = watched->next;
+	if (watched->wd >= 0) {
+		link = &watched_by_wd[watched->wd % WATCH_BUCKETS];
+		while (*link != watched)
+			link = &(*link)->wd_next;
+		*link = watched->wd_next;
+		// users sharing a home share its watch
+		bool shared = false;
+		for (struct Watched *other = watched_by_wd[watched->wd % WATCH_BUCKETS]; other && !shared;
+		     other = other->wd_next)
+			shared = other->wd == watched->wd;
+		if (!shared)
+			inotify_rm_watch(watch_inotify, watched->wd);
+	}
+	free(watched->user);
+	free(watched->reply);
+	free(watched->subscribers);
+	free(watched);
+}
+
+void watcher_adopt(struct WatchStart *start) {
+	struct Watcher *watcher = calloc(1, sizeof(struct Watcher));
+	if (watcher && watcher_count == watcher_size) {
+		int size = watcher_size ? watcher_size * 2 : 64;
+		struct Watcher **grown = realloc(watchers, size * sizeof(struct Watcher *));
+		if (grown) {
+			watchers = grown;
+			watcher_size = size;
+		}
+	}
+	struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = watcher};
+	if (!watcher || watcher_count == watcher_size || fcntl(start->fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    epoll_ctl(watch_epfd, EPOLL_CTL_ADD, start->fd, &event) < 0) {
+		close(start->fd);
+		free(watcher);
+		watch_start_free(start);
+		return;
+	}
+	watcher->fd = start->fd;
+	watcher->index = watcher_count;
+	watchers[watcher_count++] = watcher;
+	for (int i = 0; i < start->count; i++) {
+		if (!watcher_subscribe(watcher, start->users[i], start->replies[i]))
+			watcher->dead = true;
+	}
+	watch_start_free(start);
+}
+
+// after a pass, write out what each client has queued, and let go of the ones that are gone
+void watchers_sweep() {
+	for (int i = 0; i < watcher_count;) {
+		struct Watcher *watcher = watchers[i];
+		watcher_flush(watcher);
+		if (!watcher->dead) {
+			i++;
+			continue;
+		}
+		for (int j = 0; j < watcher->count; j++)
+			watched_unsubscribe(watcher->watching[j], watcher);
+		close(watcher->fd);
+		watchers[i] = watchers[--watcher_count];
+		watchers[i]->index = i;
+		free(watcher->out);
+		free(watcher);
+	}
+}
+
+// revalidate the users whose files changed, going by the inotify events waiting
+void watch_inotify_events() {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = strrchr(config.file_path, '/');
+	name = name ? name + 1 : config.file_path;
+	ssize_t len;
+	while ((len = read(watch_inotify, events, sizeof(events))) > 0) {
+		for (char *at = events; at < events + len;) {
+			const struct inotify_event *event = (const struct inotify_event *)at;
+			at += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (int b = 0; b < WATCH_BUCKETS; b++) {
+					for (struct Watched *watched = watched_users[b]; watched; watched = watched->next)
+						watched_revalidate(watched);
+				}
+				continue;
+			}
+			if (!event->len || strcmp(event->name, name) != 0 || event->wd < 0)
+				continue;
+			for (struct Watched *watched = watched_by_wd[event->wd % WATCH_BUCKETS]; watched;
+			     watched = watched->wd_next) {
+				if (watched->wd == event->wd)
+					watched_revalidate(watched);
+			}
 		}
 	}
 }
 
-char *handle_request(const char *input) {
-	bool failed = false;
+void *watcher(void *arg) {
+	(void)arg;
+	struct epoll_event events[64];
+	uint64_t next_pass = monotonic_ns() + (uint64_t)config.watch_interval * 1000000000;
+	while (true) {
+		int timeout = -1;
+		if (config.watch_interval > 0) {
+			uint64_t now = monotonic_ns();
+			timeout = next_pass > now ? (int)((next_pass - now + 999999) / 1000000) : 0;
+		}
+		int count = epoll_wait(watch_epfd, events, 64, timeout);
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr == &watch_eventfd) {
+				uint64_t value;
+				if (read(watch_eventfd, &value, sizeof(value)) < 0) {
+					// nothing to clear
+				}
+				pthread_mutex_lock(&watch_lock);
+				struct WatchStart *pending = watch_pending;
+				struct Revalidation *done = revalidated;
+				watch_pending = NULL;
+				revalidated = NULL;
+				pthread_mutex_unlock(&watch_lock);
+				while (pending) {
+					struct WatchStart *next = pending->next;
+					watcher_adopt(pending);
+					pending = next;
+				}
+				while (done) {
+					struct Revalidation *next = done->next;
+					watched_revalidated(done);
+					done = next;
+				}
+			} else if (events[i].data.ptr == &watch_inotify) {
+				watch_inotify_events();
+			} else {
+				// watching clients have nothing more to say, so anything but writability means they are done
+				struct Watcher *client = events[i].data.ptr;
+				char discard[256];
+				if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+				    read(client->fd, discard, sizeof(discard)) <= 0)
+					client->dead = true;
+			}
+		}
 
-	uid_t uid = resolve(input, &failed);
-	if (failed) {
-		return "user not found\n";
+		if (config.watch_interval > 0 && monotonic_ns() >= next_pass) {
+			for (int b = 0; b < WATCH_BUCKETS; b++) {
+				for (struct Watched *watched = watched_users[b]; watched; watched = watched->next)
+					watched_revalidate(watched);
+			}
+			next_pass = monotonic_ns() + (uint64_t)config.watch_interval * 1000000000;
+		}
+		watchers_sweep();
 	}
+	return NULL;
+}
 
-	struct passwd *pw = getpwuid(uid);
-	if (!pw) {
-		return "user not found\n";
+bool watch_init() {
+	watch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	watch_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	watch_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	struct epoll_event wake = {.events = EPOLLIN, .data.ptr = &watch_eventfd};
+	struct epoll_event notify = {.events = EPOLLIN, .data.ptr = &watch_inotify};
+	if (watch_epfd < 0 || watch_eventfd < 0 || watch_inotify < 0 ||
+	    epoll_ctl(watch_epfd, EPOLL_CTL_ADD, watch_eventfd, &wake) != 0 ||
+	    epoll_ctl(watch_epfd, EPOLL_CTL_ADD, watch_inotify, &notify) != 0)
+		return false;
+	for (int i = 0; i < WATCH_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, watch_lookup_thread, NULL) != 0)
+			return false;
+		pthread_detach(thread);
 	}
+	return true;
+}
 
-	char file_path[256];
-	snprintf(file_path, sizeof(file_path), "%s/%s", pw->pw_dir, config.file_path);
+/*
+ * answering connections
+ * a connection normally carries one query; a client can also send several queries, a line each, in which case they
+ * are answered in order until it shuts down its side; after a query, a connection is kept open for keepalive, or for
+ * BATCH_TIMEOUT_MS if that is longer or the client has started on a batch, in case more follow
+ * a connection waiting on its client doesn't hold a worker: it is parked in an epoll set the workers wait on alongside
+ * the listening socket, and taken up by whichever worker is free once the client sends more; parked connections are
+ * kept in lists in the order they are due, and one of the workers sweeps them every SWEEP_MS; past PARKED_MAX, a
+ * connection that would be parked is closed instead
+ * each query is a request of its own as far as tracing, metrics and the access log are concerned; a WATCH request
+ * hands the connection over to the watcher instead
+ * with udp set, a query can also come as a datagram of its own on the same port, and is answered with one
+ */
+#define BATCH_TIMEOUT_MS 1000 // how long a client may pause between queries, or before shutting down its side
+#define SWEEP_MS 100          // how often parked connections are checked for having waited too long
+#define PARKED_MAX 4096       // most connections parked at once
 
-	FILE *file = fopen(file_path, "r");
-	if (!file) {
-		return config.default_pronouns;
-	}
+struct Connection {
+	struct Connection *prev, *next; // in its parked list, while parked
+	int fd;
+	bool registered; // added to conn_epfd, so only needs rearming when parked again
+	bool batch;      // waiting out BATCH_TIMEOUT_MS rather than keepalive
+	bool expired;    // waited too long, and shut down for the worker taking it up to close
+	int answered;
+	uint64_t deadline; // monotonic ns by which the client has to send more
+	struct timespec accepted;
+	struct sockaddr_storage addr;
+	size_t len; // of a query not yet finished in buffer
+	char buffer[4096];
+};
+
+// one list for each of the two timeouts, so each is in the order its connections are due
+struct Parked {
+	struct Connection *head, *tail;
+} parked[2];
+pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+int conn_epfd = -1;
+uint64_t next_sweep = 0;
 
-	char pronouns[256];
-	if (fgets(pronouns, sizeof(pronouns), file)) {
-		char *cleaned = strip(pronouns);
+enum Served {
+	SERVE_DONE,    // to be closed
+	SERVE_WAIT,    // to be parked until the client sends more
+	SERVE_WATCHED, // handed over to the watcher
+};
 
-		// add newline
-		size_t len = strlen(cleaned);
-		cleaned[len] = '\n';
-		cleaned[len + 1] = '\0';
+// answer one query; started is when the read that brought it began, read when that read finished, and a datagram
+// query gets its reply sent back to client_addr
+void answer(int client_sock, const struct sockaddr_storage *client_addr, char *query, bool more, bool datagram,
+            uint64_t started, uint64_t read, const struct timespec *accepted) {
+	struct Metrics *metrics = current_worker->metrics;
+	struct Trace trace = {.seen = 0};
+	struct Trace *previous = current_trace;
+	current_trace = &trace;
+	trace_stage(STAGE_READ, started, read);
 
-		fclose(file);
-		return cleaned;
-	} else {
-		fclose(file);
-		return config.default_pronouns; // return default if file is empty
+	read_begin();
+	struct Reply reply;
+	query = strip_in_place(query);
+	handle_request(query, &reply);
+
+	// with more replies to follow, let the kernel put them in the same segment
+	uint64_t writing = monotonic_ns();
+	if (datagram)
+		sendto(client_sock, reply.response->data, reply.response->len, 0, (const struct sockaddr *)client_addr,
+		       sizeof(*client_addr));
+	else
+		send(client_sock, reply.response->data, reply.response->len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+	if (reply.table)
+		response_release(reply.table);
+	read_end();
+
+	uint64_t ended = monotonic_ns();
+	trace_stage(STAGE_WRITE, writing, ended);
+	trace_stage(STAGE_TOTAL, started, ended);
+	TRACE_PROBE3(request, query, result_names[reply.result], trace.us[STAGE_TOTAL]);
+	trace_record(&trace);
+	counter_add(&metrics->results[reply.result], 1);
+	if (config.trace_slow > 0 && trace.us[STAGE_TOTAL] >= (uint32_t)config.trace_slow * 1000) {
+		// log one in trace_sample slow requests, so a bad spell can't flood the log
+		counter_add(&metrics->slow, 1);
+		if (config.trace_sample <= 1 || metrics->slow % config.trace_sample == 1)
+			trace_log(query, reply.result, &trace);
 	}
+	if (config.access_log)
+		access_log_record(client_addr, query, reply.result, accepted, (uint32_t)((ended - started) / 1000));
+	current_trace = previous; // trace is gone once we return
+}
 
-	fclose(file);
+// take a connection off its parked list, with parked_lock held
+void parked_unlink(struct Connection *conn) {
+	struct Parked *list = &parked[conn->batch];
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		list->head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		list->tail = conn->prev;
+	__atomic_sub_fetch(&parked_count, 1, __ATOMIC_RELAXED);
 }
 
-bool drop_privileges(const char *user) {
-	struct passwd *pw = getpwnam(user);
-	if (!pw) {
-		fprintf(stderr, "User %s not found\n", user);
-		return false;
+// park a connection until its client sends more, shuts down its side, or has waited too long; closed if too many are
+void connection_park(struct Connection *conn) {
+	int timeout = config.keepalive;
+	if (conn->batch && timeout < BATCH_TIMEOUT_MS)
+		timeout = BATCH_TIMEOUT_MS;
+	conn->deadline = monotonic_ns() + (uint64_t)timeout * 1000000;
+
+	pthread_mutex_lock(&parked_lock);
+	if (parked_count >= PARKED_MAX) {
+		pthread_mutex_unlock(&parked_lock);
+		close(conn->fd);
+		free(conn);
+		return;
 	}
+	struct Parked *list = &parked[conn->batch];
+	conn->next = NULL;
+	conn->prev = list->tail;
+	if (list->tail)
+		list->tail->next = conn;
+	else
+		list->head = conn;
+	list->tail = conn;
+	__atomic_add_fetch(&parked_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&parked_lock);
 
-	if (setgid(pw->pw_gid) != 0) {
-		perror("setgid");
-		return false;
+	// once armed, another worker may have it, so registered is set first
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+	int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	conn->registered = true;
+	if (epoll_ctl(conn_epfd, op, conn->fd, &ev) == 0)
+		return;
+	pthread_mutex_lock(&parked_lock);
+	if (!conn->expired)
+		parked_unlink(conn);
+	pthread_mutex_unlock(&parked_lock);
+	close(conn->fd);
+	free(conn);
+}
+
+// take up a parked connection the client has sent more on; false if it had waited too long, and has been closed
+bool connection_take(struct Connection *conn) {
+	pthread_mutex_lock(&parked_lock);
+	bool expired = conn->expired;
+	if (!expired)
+		parked_unlink(conn);
+	pthread_mutex_unlock(&parked_lock);
+	if (expired) {
+		close(conn->fd);
+		free(conn);
 	}
+	return !expired;
+}
 
-	if (setuid(pw->pw_uid) != 0) {
-		perror("setuid");
-		return false;
+/*
+ * shut down the read side of parked connections that have waited too long; that wakes a worker on each, which closes
+ * it, as only the worker an event went to can know nothing else still holds the connection
+ */
+void connections_sweep(uint64_t now) {
+	pthread_mutex_lock(&parked_lock);
+	for (int i = 0; i < 2; i++) {
+		struct Connection *conn;
+		while ((conn = parked[i].head) && conn->deadline <= now) {
+			parked_unlink(conn);
+			conn->expired = true;
+			shutdown(conn->fd, SHUT_RD);
+		}
 	}
+	pthread_mutex_unlock(&parked_lock);
+}
 
-	return true;
+// a health check from a proxy sharding over this pronound; answered without a lookup, and left out of metrics and the
+// access log
+bool health_request(const char *query) {
+	return strcmp(query, HEALTH_REQUEST) == 0;
 }
 
-bool split_first_space(const char *str, char **first, char **rest) {
-	const char *space = strchr(str, ' ');
-	if (!space) {
-		*first = strdup(str);
-		*rest = NULL;
-		return true;
-	}
+// hand a connection over to the watcher, which has an epoll set of its own
+enum Served serve_watch(struct Connection *conn, char *query) {
+	if (conn->registered)
+		epoll_ctl(conn_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	return watch_start(conn->fd, query) ? SERVE_WATCHED : SERVE_DONE;
+}
 
-	size_t first_len = space - str;
-	*first = malloc(first_len + 1);
-	if (!*first)
-		return false;
+// read whatever the client has sent so far, and answer each query in it
+enum Served serve(struct Connection *conn) {
+	char *buffer = conn->buffer;
+	uint64_t started = monotonic_ns();
+	while (true) {
+		ssize_t bytes_read = recv(conn->fd, buffer + conn->len, sizeof(conn->buffer) - 1 - conn->len, MSG_DONTWAIT);
+		if (bytes_read < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (daemonised) {
+				syslog(LOG_WARNING, "read failed %m");
+			} else {
+				perror("read");
+			}
+			return SERVE_DONE;
+		}
+		uint64_t read = monotonic_ns();
+		conn->len += bytes_read;
+		buffer[conn->len] = '\0';
 
-	strncpy(*first, str, first_len);
-	(*first)[first_len] = '\0';
+		// a query without a newline, one cut short by the client shutting down, or one too long for the buffer, is
+		// answered as it is
+		bool has_line = memchr(buffer, '\n', conn->len) != NULL;
+		if (bytes_read == 0 ||
+		    (!has_line && (conn->answered == 0 || conn->len == sizeof(conn->buffer) - 1))) {
+			char *query = strip_in_place(buffer);
+			if (watch_request(query))
+				return serve_watch(conn, query);
+			if (health_request(query))
+				send(conn->fd, HEALTH_REPLY, strlen(HEALTH_REPLY), MSG_NOSIGNAL);
+			else if (conn->len || conn->answered == 0)
+				answer(conn->fd, &conn->addr, buffer, false, false, started, read, &conn->accepted);
+			if (bytes_read == 0 || conn->answered == 0)
+				return SERVE_DONE;
+			conn->answered++;
+			conn->len = 0;
+		}
 
-	*rest = strdup(space + 1);
-	return true;
-}
+		char *line = buffer, *newline;
+		while ((newline = memchr(line, '\n', buffer + conn->len - line))) {
+			*newline = '\0';
+			char *query = strip_in_place(line);
+			if (watch_request(query))
+				return serve_watch(conn, query); // anything sent after it is ignored
+			bool more = memchr(newline + 1, '\n', buffer + conn->len - newline - 1) != NULL;
+			if (health_request(query))
+				send(conn->fd, HEALTH_REPLY, strlen(HEALTH_REPLY), MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+			else
+				answer(conn->fd, &conn->addr, line, more, false, started, read, &conn->accepted);
+			conn->answered++;
+			line = newline + 1;
+		}
+		conn->len = buffer + conn->len - line;
+		memmove(buffer, line, conn->len);
+		started = monotonic_ns();
+	}
 
-bool parse_config(const char *filename) {
 	/*
-	 * config file format:
-	 * daemonise <true|false>
-	 * default_pronouns <pronouns>
-	 * file_path <path>
-	 * port <port>
-	 * daemon_user <user>
+	 * a client that has sent one query and nothing since is kept for keepalive, and with it off is done; one that has
+	 * started on a second line, or sent several, is in a batch, and gets a while to send the rest
 	 */
+	if (conn->answered == 1 && !conn->len && config.keepalive <= 0)
+		return SERVE_DONE;
+	conn->batch = conn->answered != 1 || conn->len;
+	return SERVE_WAIT;
+}
 
-	char *config_file = getenv("PRONOUND_CONFIG");
-	if (!config_file)
-		config_file = (char *)filename;
-
-	if (!config_file)
-		config_file = "/etc/pronound.conf";
+// a parked connection needs to outlive the worker's stack, so is copied to the heap with what it has read so far
+struct Connection *connection_copy(const struct Connection *conn) {
+	size_t size = offsetof(struct Connection, buffer) + conn->len + 1;
+	struct Connection *copy = malloc(sizeof(struct Connection));
+	if (copy)
+		memcpy(copy, conn, size);
+	return copy;
+}
 
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		perror("Could not open config file");
-		return false;
-	}
+/*
+ * accept and answer requests, and take up parked connections the client has sent more on; config.workers of these
+ * run side by side, each waiting on conn_epfd
+ */
+void *worker(void *arg) {
+	current_worker = arg;
+	struct Metrics *metrics = current_worker->metrics;
+	struct Connection fresh;
+	while (true) {
+		struct epoll_event event;
+		int ready = epoll_wait(conn_epfd, &event, 1, SWEEP_MS);
+		uint64_t now = monotonic_ns();
+		uint64_t due = __atomic_load_n(&next_sweep, __ATOMIC_RELAXED);
+		if (now >= due && __atomic_compare_exchange_n(&next_sweep, &due, now + SWEEP_MS * 1000000ULL, false,
+		                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			connections_sweep(now);
+		if (ready < 1)
+			continue;
 
-	char line[256];
-	while (fgets(line, sizeof(line), file)) {
-		char *key, *value;
-		char *cleaned_line = strip(line);
-		if (strlen(cleaned_line) == 0 || cleaned_line[0] == '#') {
-			free(cleaned_line);
-			continue; // skip empty lines and comments
-		}
-		if (!split_first_space(cleaned_line, &key, &value)) {
-			free(cleaned_line);
-			fclose(file);
-			return false; // error splitting line
+		struct Connection *conn = event.data.ptr;
+		if (!conn) {
+			// the listening socket, which every waiting worker may be woken for
+			socklen_t addr_len = sizeof(fresh.addr);
+			int client_sock = accept(sockfd, (struct sockaddr *)&fresh.addr, &addr_len);
+			if (client_sock < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					continue;
+				if (daemonised) {
+					syslog(LOG_WARNING, "accept failed %m");
+				} else {
+					perror("accept");
+				}
+				continue; // continue to the next iteration on error
+			}
+			conn = &fresh;
+			conn->fd = client_sock;
+			conn->registered = conn->expired = false;
+			conn->answered = 0;
+			conn->len = 0;
+			clock_gettime(CLOCK_REALTIME, &conn->accepted);
+		} else if (!connection_take(conn)) {
+			continue;
 		}
 
-		if (strcmp(key, "daemonise") == 0) {
-			config.daemonise = (value && (strcmp(value, "true") == 0 || strcmp(value, "1") == 0));
-		} else if (strcmp(key, "defaults") == 0) {
-			// ensure terminated in newline
-			char *newline = malloc(strlen(value) + 2);
-			if (!newline) {
-				free(key);
-				free(value);
-				free(cleaned_line);
-				fclose(file);
-				return false;
+		__atomic_store_n(&metrics->active, 1, __ATOMIC_RELAXED);
+		enum Served served = serve(conn);
+		__atomic_store_n(&metrics->active, 0, __ATOMIC_RELAXED);
+		if (served == SERVE_WAIT) {
+			if (conn == &fresh && !(conn = connection_copy(&fresh))) {
+				close(fresh.fd);
+				continue;
 			}
-			strcpy(newline, value);
-			newline[strlen(value)] = '\n';
-			newline[strlen(value) + 1] = '\0';
-			config.default_pronouns = newline;
-		} else if (strcmp(key, "file") == 0) {
-			config.file_path = strdup(value);
-		} else if (strcmp(key, "port") == 0) {
-			config.port = atoi(value);
-		} else if (strcmp(key, "user") == 0) {
-			config.daemon_user = strdup(value);
+			connection_park(conn);
+			continue;
 		}
+		if (served == SERVE_DONE)
+			close(conn->fd);
+		if (conn != &fresh)
+			free(conn);
 	}
-	return true;
+	return NULL;
 }
 
-void daemonise() {
-	pid_t pid = fork();
-	if (pid < 0) {
-		perror("fork");
-		exit(1);
-	}
-	if (pid > 0) {
-		exit(0); // parent exits
-	}
+// make the listening socket one of the things workers wait on
+bool connections_init() {
+	// a connection is only accepted once its query has come, so it can usually be answered there and then
+	setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &(int){1}, sizeof(int));
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	conn_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (conn_epfd < 0)
+		return false;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	return epoll_ctl(conn_epfd, EPOLL_CTL_ADD, sockfd, &ev) == 0;
+}
 
-	if (setsid() < 0) {
-		perror("setsid");
-		exit(1);
+// bind the socket queries sent as datagrams arrive on, -1 if it couldn't be
+int udp_bind(const char *port) {
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE}, *res;
+	if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+		error("getaddrinfo failed for udp");
+		return -1;
 	}
-
-	umask(0); // clear file mode creation mask
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
-
-	open("/dev/null", O_RDONLY);
-	open("/dev/null", O_WRONLY);
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		error("udp bind failed");
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
 }
 
-void handle_signal(int sig) {
-	if (sig == SIGINT || sig == SIGTERM) {
-		close(sockfd);
-		exit(0);
-	}
-	if (sig == SIGHUP) {
-		// Reload configuration if needed
-		if (!parse_config("/etc/pronound.conf")) {
-			fprintf(stderr, "Failed to reload config file\n");
+// answer queries sent as datagrams, one to a datagram and a datagram back; with udp set, config.workers of these run
+// alongside the workers
+void *udp_worker(void *arg) {
+	current_worker = arg;
+	while (true) {
+		char buffer[512];
+		struct sockaddr_storage client_addr;
+		socklen_t addr_len = sizeof(client_addr);
+		// MSG_TRUNC gives the whole length, so a query too long for the buffer is dropped rather than cut short
+		ssize_t bytes_read = recvfrom(udp_sockfd, buffer, sizeof(buffer) - 1, MSG_TRUNC, (struct sockaddr *)&client_addr,
+		                              &addr_len);
+		if (bytes_read < 0) {
+			if (daemonised) {
+				syslog(LOG_WARNING, "recvfrom failed %m");
+			} else {
+				perror("recvfrom");
+			}
+			continue;
 		}
+		if ((size_t)bytes_read >= sizeof(buffer))
+			continue;
+		uint64_t read = monotonic_ns();
+		struct timespec accepted;
+		clock_gettime(CLOCK_REALTIME, &accepted);
+		buffer[bytes_read] = '\0';
 
-        if (config.daemonise && !daemonised) {
-            daemonised = true;
-            daemonise();
-        }
+		// watching needs a connection to send changes down
+		char *query = strip_in_place(buffer);
+		if (watch_request(query))
+			continue;
+		answer(udp_sockfd, &client_addr, query, false, true, read, read, &accepted);
 	}
+	return NULL;
 }
 
 int main(int argc, char *argv[]) {
-	if (getuid() != 0) {
-		fprintf(stderr, "pronound must be run as root\n");
-		return 1;
-	}
-
-	if (!parse_config("/etc/pronound.conf")) {
-		fprintf(stderr, "Failed to parse config file\n");
-		return 1;
-	}
-
-	signal(SIGINT, handle_signal);
-	signal(SIGTERM, handle_signal);
-	signal(SIGHUP, handle_signal);
-
-	char *config_file = getenv("PRONOUND_CONFIG");
-	if (!config_file) {
-		config_file = "/etc/pronound.conf";
+	started_at = monotonic_seconds();
+	if (getenv("PRONOUND_CONFIG")) {
+		config_path = getenv("PRONOUND_CONFIG");
 	}
 
 	bool should_daemonise = false;
@@ -319,7 +4536,7 @@ int main(int argc, char *argv[]) {
 				should_daemonise = 1;
 				break;
 			case 'C':
-				config_file = optarg;
+				config_path = optarg;
 				break;
 			default:
 				fprintf(stderr, "Usage: %s [-d] [-C config_file]\n", argv[0]);
@@ -327,6 +4544,27 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (!parse_config(config_path)) {
+		fprintf(stderr, "Failed to parse config file\n");
+		return 1;
+	}
+
+	// with a fixture passwd file there are no real users to read the files of, so root isn't needed
+	if (getuid() != 0 && !config.passwd_file) {
+		fprintf(stderr, "pronound must be run as root\n");
+		return 1;
+	}
+
+	if (config.passwd_file && !fixture_load(config.passwd_file)) {
+		fprintf(stderr, "Failed to load passwd file\n");
+		return 1;
+	}
+
+	if (!responses_init()) {
+		fprintf(stderr, "Failed to build response table\n");
+		return 1;
+	}
+
 	openlog("pronound", LOG_PID | LOG_NDELAY, LOG_DAEMON);
 
 	if (config.daemonise || should_daemonise) {
@@ -370,47 +4608,163 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	drop_privileges(config.daemon_user); // now we are bound to port
+	if (config.udp && (udp_sockfd = udp_bind(port_str)) < 0) {
+		close(sockfd);
+		freeaddrinfo(res);
+		return 1;
+	}
+	if (config.metrics && (metrics_sockfd = listen_at(config.metrics, "metrics", 0666)) < 0) {
+		close(sockfd);
+		freeaddrinfo(res);
+		return 1;
+	}
+	// snapshots hold every user, so a unix socket for them is only open to root
+	if (config.snapshot_serve && (snapshot_sockfd = listen_at(config.snapshot_serve, "snapshot", 0600)) < 0) {
+		close(sockfd);
+		freeaddrinfo(res);
+		return 1;
+	}
+	if (config.admin_socket && (admin_sockfd = listen_unix(config.admin_socket, 0600)) < 0) {
+		close(sockfd);
+		freeaddrinfo(res);
+		return 1;
+	}
+
+	if (getuid() == 0)
+		drop_privileges(config.daemon_user); // now we are bound to port
 
-	if (listen(sockfd, 5) < 0) {
+	if (listen(sockfd, SOMAXCONN) < 0) {
 		error("listen failed");
 		close(sockfd);
 		freeaddrinfo(res);
 		return 1;
 	}
 
-	while (true) {
-		struct sockaddr_storage client_addr;
-		socklen_t addr_len = sizeof(client_addr);
-		int client_sock = accept(sockfd, (struct sockaddr *)&client_addr, &addr_len);
-		if (client_sock < 0) {
-			if (daemonised) {
-				syslog(LOG_WARNING, "accept failed %m");
-			} else {
-				perror("accept");
-			}
-			continue; // continue to the next iteration on error
+	freeaddrinfo(res);
+
+	if (!connections_init()) {
+		error("failed to set up the listening socket");
+		close(sockfd);
+		return 1;
+	}
+
+	// signals are taken synchronously by the main thread, so block them before the workers inherit the mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (config.workers < 1)
+		config.workers = 1;
+	// udp workers get slots of their own after the others, for their epochs, access logs and metrics
+	worker_count = config.workers * (udp_sockfd >= 0 ? 2 : 1);
+	if (posix_memalign((void **)&workers, 64, worker_count * sizeof(struct Worker)) != 0) {
+		error("failed to allocate workers");
+		close(sockfd);
+		return 1;
+	}
+	memset(workers, 0, worker_count * sizeof(struct Worker));
+	for (int i = 0; i < worker_count; i++) {
+		if (posix_memalign((void **)&workers[i].log, 64, sizeof(struct AccessRing)) != 0) {
+			error("failed to allocate access log");
+			close(sockfd);
+			return 1;
+		}
+		memset(workers[i].log, 0, sizeof(struct AccessRing));
+		workers[i].metrics = calloc(1, sizeof(struct Metrics));
+		if (!workers[i].metrics) {
+			error("failed to allocate metrics");
+			close(sockfd);
+			return 1;
+		}
+	}
+	for (int i = 0; i < worker_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, i < config.workers ? worker : udp_worker, &workers[i]) != 0) {
+			error("failed to start worker");
+			close(sockfd);
+			return 1;
 		}
+		pthread_detach(thread);
+	}
 
-		char buffer[256];
-		ssize_t bytes_read = read(client_sock, buffer, sizeof(buffer) - 1);
-		if (bytes_read < 0) {
-			if (daemonised) {
-				syslog(LOG_WARNING, "read failed %m");
-			} else {
-				perror("read");
-			}
-			close(client_sock);
-			continue; // continue to the next iteration on error
+	pthread_t refresh_thread;
+	if (pthread_create(&refresh_thread, NULL, refresher, NULL) != 0) {
+		error("failed to start refresher");
+		close(sockfd);
+		return 1;
+	}
+	pthread_detach(refresh_thread);
+
+	if (!health_start()) {
+		error("failed to start health checker");
+		close(sockfd);
+		return 1;
+	}
+
+	if (config.snapshot_serve || config.replicate) {
+		pthread_t snapshot_thread;
+		if (pthread_create(&snapshot_thread, NULL, config.replicate ? replicator : snapshot_builder, NULL) != 0) {
+			error("failed to start snapshots");
+			close(sockfd);
+			return 1;
+		}
+		pthread_detach(snapshot_thread);
+	}
+
+	if (snapshot_sockfd >= 0) {
+		pthread_t snapshot_listen_thread;
+		if (pthread_create(&snapshot_listen_thread, NULL, snapshot_listener, NULL) != 0) {
+			error("failed to start snapshot listener");
+			close(sockfd);
+			return 1;
 		}
+		pthread_detach(snapshot_listen_thread);
+	}
+
+	pthread_t watch_thread;
+	if (!watch_init() || pthread_create(&watch_thread, NULL, watcher, NULL) != 0) {
+		error("failed to start watcher");
+		close(sockfd);
+		return 1;
+	}
+	pthread_detach(watch_thread);
 
-		char *clean = strip(buffer);
+	pthread_t log_thread;
+	if (pthread_create(&log_thread, NULL, access_logger, NULL) != 0) {
+		error("failed to start access logger");
+		close(sockfd);
+		return 1;
+	}
+	pthread_detach(log_thread);
 
-		char *response = handle_request(clean);
+	if (metrics_sockfd >= 0) {
+		pthread_t metrics_thread;
+		if (pthread_create(&metrics_thread, NULL, metrics_listener, NULL) != 0) {
+			error("failed to start metrics listener");
+			close(sockfd);
+			return 1;
+		}
+		pthread_detach(metrics_thread);
+	}
 
-		write(client_sock, response, strlen(response));
+	if (admin_sockfd >= 0) {
+		pthread_t admin_thread;
+		if (pthread_create(&admin_thread, NULL, admin_listener, NULL) != 0) {
+			error("failed to start admin listener");
+			close(sockfd);
+			return 1;
+		}
+		pthread_detach(admin_thread);
+	}
 
-		close(client_sock);
+	while (true) {
+		int sig;
+		if (sigwait(&signals, &sig) == 0)
+			handle_signal(sig);
 	}
 
 	return 0;